@@ -0,0 +1,39 @@
+#include "affinity.h"
+
+#include <algorithm>
+#include <barrier>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+void
+pinThreads(bvh::v2::ThreadPool& threadPool, const std::size_t firstCore)
+{
+#ifdef __linux__
+  const auto threadCount = threadPool.get_thread_count();
+
+  const std::size_t coreCount = std::max(1u, std::thread::hardware_concurrency());
+
+  // Every task waits until all of them are running, so each worker picks up exactly one task.
+
+  std::barrier sync(static_cast<std::ptrdiff_t>(threadCount));
+
+  for (std::size_t i = 0; i < threadCount; i++) {
+    threadPool.push([&](const std::size_t threadId) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET((firstCore + threadId) % coreCount, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      sync.arrive_and_wait();
+    });
+  }
+
+  threadPool.wait();
+#else
+  (void)threadPool;
+  (void)firstCore;
+#endif
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <bvh/v2/thread_pool.h>
+
+#include <cstddef>
+
+// Pins each worker of the thread pool to its own core, starting at the given core index.
+// Does nothing on platforms without thread affinity support.
+void
+pinThreads(bvh::v2::ThreadPool& threadPool, std::size_t firstCore = 0);
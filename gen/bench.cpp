@@ -0,0 +1,290 @@
+#include "image.h"
+#include "renderer.h"
+#include "scene.h"
+
+#include <glm/gtx/transform.hpp>
+
+#include <bvh/v2/thread_pool.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <cstdlib>
+
+namespace {
+
+using Vec3 = bvh::v2::Vec<float, 3>;
+
+void
+loadScene(Scene& scene)
+{
+  const char* staticModels[]{ "room",        "ejection_tunnel", "big_sphere",  "little_sphere", "cone",
+                              "left_shelf",  "big_cube",        "little_cube", "right_shelf",   "torus" };
+
+  for (const auto* name : staticModels) {
+    const auto path = std::string(MODEL_PATH "/") + name + ".stl";
+    scene.loadModel(path.c_str(), Vec3(0.8f, 0.8f, 0.8f), Vec3(0, 0, 0), Vec3(0, 0, 0));
+  }
+
+  const auto staticCount = scene.modelCount();
+
+  scene.loadModel(MODEL_PATH "/monkey.stl", Vec3(0.8f, 0.2f, 0.2f), Vec3(0, 0, 0), Vec3(1, 0, 0));
+
+  scene.instanceRange(0, staticCount);
+
+  scene.instanceSingle(staticCount,
+                       glm::translate(glm::vec3(0.0f, 6.0f, 0.0f)) * glm::rotate(glm::radians(30.0f), glm::vec3(0, 1, 0)),
+                       std::nullopt,
+                       true);
+}
+
+// Renders the default 256x256 scene with 1 to N threads and reports the speedup over one thread.
+void
+reportScaling(const std::size_t maxThreads, const Renderer::Mode mode)
+{
+  std::vector<std::size_t> threadCounts;
+
+  for (std::size_t n = 1; n < maxThreads; n *= 2)
+    threadCounts.emplace_back(n);
+
+  threadCounts.emplace_back(maxThreads);
+
+  double baseline{ 0 };
+
+  std::cout << "threads  seconds  speedup  efficiency" << std::endl;
+
+  for (const auto threadCount : threadCounts) {
+
+    bvh::v2::ThreadPool threadPool(threadCount);
+
+    Scene scene(threadPool);
+
+    loadScene(scene);
+
+    scene.commit();
+
+    Renderer renderer(256, 256, 1234, threadPool);
+
+    renderer.setMode(mode);
+
+    const auto t0 = std::chrono::steady_clock::now();
+
+    renderer.render(scene, Vec3(-30, 5, 0));
+
+    const auto t1 = std::chrono::steady_clock::now();
+
+    const auto seconds = std::chrono::duration<double>(t1 - t0).count();
+
+    if (threadCount == 1)
+      baseline = seconds;
+
+    const auto speedup = baseline / seconds;
+
+    std::cout << std::setw(7) << threadCount << std::fixed << std::setprecision(3) << std::setw(9) << seconds
+              << std::setw(9) << speedup << std::setw(12) << (speedup / static_cast<double>(threadCount))
+              << std::endl;
+  }
+}
+
+// Renders the default scene with the buffers of a few typical jobs, to show what skipping the path tracing saves.
+void
+reportBufferMasks()
+{
+  struct Job final
+  {
+    const char* name;
+
+    std::uint32_t buffers;
+  };
+
+  const Job jobs[]{
+    { "all", Renderer::BufferAll },
+    { "noisy and color", Renderer::BufferNoisy | Renderer::BufferColor },
+    { "noisy", Renderer::BufferNoisy },
+    { "stencil", Renderer::BufferStencil },
+  };
+
+  bvh::v2::ThreadPool threadPool;
+
+  Scene scene(threadPool);
+
+  loadScene(scene);
+
+  scene.commit();
+
+  Renderer renderer(256, 256, 1234, threadPool);
+
+  std::cout << "buffers            seconds" << std::endl;
+
+  for (const auto& job : jobs) {
+
+    const auto t0 = std::chrono::steady_clock::now();
+
+    renderer.render(scene, Vec3(-30, 5, 0), job.buffers);
+
+    const auto t1 = std::chrono::steady_clock::now();
+
+    std::cout << std::left << std::setw(16) << job.name << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << std::chrono::duration<double>(t1 - t0).count() << std::endl;
+  }
+}
+
+// Drops the object through a scene of 64 objects for a simulation's worth of frames, and reports the time of the
+// first commit, which builds the top level BVH, against the mean of the following ones, which mostly refit it.
+void
+reportCommit()
+{
+  const Scene::Quality qualities[]{ Scene::Quality::Low, Scene::Quality::Medium, Scene::Quality::High };
+
+  const char* names[]{ "low", "medium", "high" };
+
+  bvh::v2::ThreadPool threadPool;
+
+  Scene scene(threadPool);
+
+  loadScene(scene);
+
+  const auto objectModel = scene.modelCount() - 1;
+
+  constexpr int frames{ 47 };
+
+  std::cout << "quality  build ms  frame ms" << std::endl;
+
+  for (int q = 0; q < 3; q++) {
+
+    scene.clear();
+
+    scene.instanceRange(0, objectModel);
+
+    const auto objectInstance =
+      scene.instanceSingle(objectModel, glm::translate(glm::vec3(0.0f, 6.0f, 0.0f)), std::nullopt, true);
+
+    scene.randomize(Scene::Placement{ objectModel, 1, Vec3(-20, 0, -20), Vec3(20, 0, 20), 2.0f }, 63, 1234);
+
+    const auto t0 = std::chrono::steady_clock::now();
+
+    scene.commit(qualities[q]);
+
+    const auto t1 = std::chrono::steady_clock::now();
+
+    for (int i = 1; i <= frames; i++) {
+      const auto y = 6.0f - 0.0025f * static_cast<float>(i * i);
+      scene.setInstanceTransform(objectInstance,
+                                 glm::translate(glm::vec3(0.0f, y, 0.0f)) *
+                                   glm::rotate(glm::radians(7.0f * static_cast<float>(i)), glm::vec3(0, 1, 0)));
+      scene.commit(qualities[q]);
+    }
+
+    const auto t2 = std::chrono::steady_clock::now();
+
+    std::cout << std::left << std::setw(7) << names[q] << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << (std::chrono::duration<double>(t1 - t0).count() * 1.0e3) << std::setw(10)
+              << (std::chrono::duration<double>(t2 - t1).count() * 1.0e3 / frames) << std::endl;
+  }
+}
+
+// Encodes a rendered frame at 256x256 and 1024x1024 with each PNG configuration, and reports throughput and size.
+void
+reportPngEncoding()
+{
+  struct Config final
+  {
+    const char* name;
+
+    PngOptions options;
+  };
+
+  const Config configs[]{
+    { "stb level 8", PngOptions{ PngOptions::Encoder::Stb, 8, -1 } },
+    { "stb level 5", PngOptions{ PngOptions::Encoder::Stb, 5, -1 } },
+    { "fast", PngOptions{ PngOptions::Encoder::Fast, 1, -1 } },
+    { "fast, up filter", PngOptions{ PngOptions::Encoder::Fast, 1, 2 } },
+    { "store", PngOptions{ PngOptions::Encoder::Fast, 0, -1 } },
+  };
+
+  bvh::v2::ThreadPool threadPool;
+
+  Scene scene(threadPool);
+
+  loadScene(scene);
+
+  scene.commit();
+
+  for (const int size : { 256, 1024 }) {
+
+    Renderer renderer(size, size, 1234, threadPool);
+
+    renderer.setSampling(Renderer::Sampling{ { 1 }, 4 });
+
+    const auto result = renderer.render(scene, Vec3(-30, 5, 0));
+
+    const auto raw_bytes = static_cast<double>(size) * static_cast<double>(size) * 3.0;
+
+    std::cout << size << 'x' << size << std::endl;
+
+    std::cout << "encoder             MB/s      bytes  ratio" << std::endl;
+
+    for (const auto& config : configs) {
+
+      setPngOptions(config.options);
+
+      std::vector<unsigned char> encoded;
+
+      const int repeats = (size == 256) ? 20 : 2;
+
+      const auto t0 = std::chrono::steady_clock::now();
+
+      for (int i = 0; i < repeats; i++)
+        encodePng(result.color, encoded);
+
+      const auto t1 = std::chrono::steady_clock::now();
+
+      const auto seconds = std::chrono::duration<double>(t1 - t0).count() / repeats;
+
+      std::cout << std::left << std::setw(16) << config.name << std::right << std::fixed << std::setprecision(1)
+                << std::setw(9) << (raw_bytes / seconds / 1.0e6) << std::setw(11) << encoded.size()
+                << std::setprecision(3) << std::setw(7) << (static_cast<double>(encoded.size()) / raw_bytes)
+                << std::endl;
+    }
+
+    std::cout << std::endl;
+  }
+
+  setPngOptions(PngOptions{});
+}
+
+} // namespace
+
+int
+main(int argc, char** argv)
+{
+  std::size_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+
+  if (argc > 1)
+    maxThreads = std::max(1, std::atoi(argv[1]));
+
+  std::cout << "depth first" << std::endl;
+
+  reportScaling(maxThreads, Renderer::Mode::DepthFirst);
+
+  std::cout << std::endl << "wavefront" << std::endl;
+
+  reportScaling(maxThreads, Renderer::Mode::Wavefront);
+
+  std::cout << std::endl << "buffer masks" << std::endl;
+
+  reportBufferMasks();
+
+  std::cout << std::endl << "scene commit" << std::endl;
+
+  reportCommit();
+
+  std::cout << std::endl << "png encoding" << std::endl;
+
+  reportPngEncoding();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,506 @@
+#include "config.h"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include <cstring>
+
+namespace {
+
+using Setter = std::function<void(Config&, const std::string&)>;
+
+struct Key final
+{
+  const char* name;
+
+  const char* help;
+
+  Setter set;
+};
+
+std::string
+trim(const std::string& text)
+{
+  const auto* space = " \t\r\n";
+  const auto begin = text.find_first_not_of(space);
+  if (begin == std::string::npos)
+    return {};
+  return text.substr(begin, text.find_last_not_of(space) - begin + 1);
+}
+
+// '#' and ';' start a comment at the start of a line or after white space, so that values such as paths may
+// contain them.
+std::size_t
+findComment(const std::string& line)
+{
+  for (std::size_t i = 0; i < line.size(); i++) {
+    if (((line[i] == '#') || (line[i] == ';')) && ((i == 0) || std::strchr(" \t", line[i - 1])))
+      return i;
+  }
+  return std::string::npos;
+}
+
+// Splits on white space and commas.
+std::vector<std::string>
+split(const std::string& text)
+{
+  std::string spaced(text);
+  std::replace(spaced.begin(), spaced.end(), ',', ' ');
+
+  std::istringstream stream(spaced);
+  std::vector<std::string> words;
+  for (std::string word; stream >> word;)
+    words.emplace_back(word);
+  return words;
+}
+
+template<typename T>
+T
+parseNumber(const std::string& text)
+{
+  std::istringstream stream(trim(text));
+  T value{};
+  if (!(stream >> value) || !stream.eof())
+    throw std::runtime_error("'" + text + "' is not a valid number.");
+  return value;
+}
+
+template<typename T>
+T
+parseCount(const std::string& text, const T min, const T max = std::numeric_limits<T>::max())
+{
+  const auto value = parseNumber<long long>(text);
+  if (value < static_cast<long long>(min))
+    throw std::runtime_error("'" + text + "' is less than " + std::to_string(min) + ".");
+  // Compared as unsigned, since the maximum of an unsigned T does not fit in a long long.
+  if ((value > 0) && (static_cast<unsigned long long>(value) > static_cast<unsigned long long>(max)))
+    throw std::runtime_error("'" + text + "' is more than " + std::to_string(max) + ".");
+  return static_cast<T>(value);
+}
+
+float
+parsePositive(const std::string& text)
+{
+  const auto value = parseNumber<float>(text);
+  if (!(value > 0.0f))
+    throw std::runtime_error("'" + text + "' is not positive.");
+  return value;
+}
+
+bool
+parseBool(const std::string& text)
+{
+  const auto value = trim(text);
+  if ((value == "true") || (value == "yes") || (value == "on") || (value == "1"))
+    return true;
+  if ((value == "false") || (value == "no") || (value == "off") || (value == "0"))
+    return false;
+  throw std::runtime_error("'" + text + "' is not a boolean.");
+}
+
+bvh::v2::Vec<float, 3>
+parseVec3(const std::vector<std::string>& words, const std::size_t offset)
+{
+  if (words.size() < (offset + 3))
+    throw std::runtime_error("Expected three components after '" + words[offset - 1] + "'.");
+
+  return { parseNumber<float>(words[offset]),
+           parseNumber<float>(words[offset + 1]),
+           parseNumber<float>(words[offset + 2]) };
+}
+
+bvh::v2::Vec<float, 3>
+parseVec3(const std::string& text)
+{
+  auto words = split(text);
+  if (words.size() != 3)
+    throw std::runtime_error("'" + text + "' is not a vector of three components.");
+  words.insert(words.begin(), std::string());
+  return parseVec3(words, 1);
+}
+
+// 'path [r g b [r g b]]', the albedo followed by the emission.
+ModelConfig
+parseModel(const std::string& text)
+{
+  const auto words = split(text);
+
+  if ((words.size() != 1) && (words.size() != 4) && (words.size() != 7))
+    throw std::runtime_error("'" + text + "' is not of the form 'path [r g b [r g b]]'.");
+
+  ModelConfig model;
+
+  model.path = words[0];
+
+  if (words.size() >= 4) {
+    model.hasAlbedo = true;
+    model.albedo = parseVec3(words, 1);
+  }
+
+  if (words.size() == 7)
+    model.emission = parseVec3(words, 4);
+
+  return model;
+}
+
+std::uint32_t
+parseOutputs(const std::string& text)
+{
+  static const std::pair<const char*, std::uint32_t> names[]{
+    { "noisy", OutputNoisy },
+    { "color", OutputColor },
+    { "albedo", OutputAlbedo },
+    { "normal", OutputNormal },
+    { "depth", OutputDepth },
+    { "segmentation", OutputSegmentation },
+    { "stencil", OutputStencil },
+    { "annotation", OutputAnnotation },
+    { "instance_id", OutputInstanceId },
+    { "masks", OutputMasks },
+    { "all", OutputAll },
+  };
+
+  std::uint32_t outputs{ 0 };
+
+  for (const auto& word : split(text)) {
+    auto it = std::find_if(std::begin(names), std::end(names), [&word](const auto& n) { return word == n.first; });
+    if (it == std::end(names))
+      throw std::runtime_error("'" + word + "' is not an output.");
+    outputs |= it->second;
+  }
+
+  return outputs;
+}
+
+template<typename T>
+T
+parseEnum(const std::string& text, const std::vector<std::pair<const char*, T>>& names)
+{
+  const auto value = trim(text);
+
+  for (const auto& n : names) {
+    if (value == n.first)
+      return n.second;
+  }
+
+  std::string expected;
+
+  for (const auto& n : names)
+    expected += (expected.empty() ? "" : ", ") + std::string(n.first);
+
+  throw std::runtime_error("'" + text + "' is not one of " + expected + ".");
+}
+
+// Keeps pixel counts, and the offsets into images computed from them, well within an int.
+constexpr int max_image_size{ 16384 };
+
+const std::vector<Key>&
+keys()
+{
+  static const std::vector<Key> table{
+    { "image.width",
+      "The width of the images.",
+      [](Config& c, const std::string& v) { c.width = parseCount(v, 1, max_image_size); } },
+    { "image.height",
+      "The height of the images.",
+      [](Config& c, const std::string& v) { c.height = parseCount(v, 1, max_image_size); } },
+
+    { "run.seed",
+      "The seed every simulation's seed is derived from.",
+      [](Config& c, const std::string& v) { c.seed = parseNumber<int>(v); } },
+    { "run.threads",
+      "The number of render threads, 0 for all of them.",
+      [](Config& c, const std::string& v) { c.threads = parseCount<std::size_t>(v, 0); } },
+    { "run.pin_threads",
+      "Whether the render threads are pinned to cores.",
+      [](Config& c, const std::string& v) { c.pinThreads = parseBool(v); } },
+    { "run.first",
+      "The index of the first simulation to run.",
+      [](Config& c, const std::string& v) { c.first = parseCount<std::size_t>(v, 0); } },
+    { "run.last",
+      "The index after the last simulation to run.",
+      [](Config& c, const std::string& v) { c.last = parseCount<std::size_t>(v, 0); } },
+    { "run.concurrency",
+      "The number of simulations that run at the same time.",
+      [](Config& c, const std::string& v) { c.concurrency = parseCount<std::size_t>(v, 1); } },
+    { "run.simulations",
+      "The number of simulations in the dataset.",
+      [](Config& c, const std::string& v) { c.simulationCount = parseCount<std::size_t>(v, 1); } },
+    { "run.training",
+      "How many of the simulations go to the training set.",
+      [](Config& c, const std::string& v) { c.trainingCount = parseCount<std::size_t>(v, 0); } },
+
+    { "simulation.duration",
+      "The length of a simulation in seconds.",
+      [](Config& c, const std::string& v) { c.duration = parsePositive(v); } },
+    { "simulation.dt",
+      "The time between two frames in seconds.",
+      [](Config& c, const std::string& v) { c.dt = parsePositive(v); } },
+    { "simulation.camera_min",
+      "The lower corner of the box the camera is placed in.",
+      [](Config& c, const std::string& v) { c.cameraMin = parseVec3(v); } },
+    { "simulation.camera_max",
+      "The upper corner of the box the camera is placed in.",
+      [](Config& c, const std::string& v) { c.cameraMax = parseVec3(v); } },
+
+    { "simulation.objects",
+      "The number of objects in a simulation: the dropped one, and the rest resting on the floor.",
+      [](Config& c, const std::string& v) { c.objectCount = parseCount(v, 1); } },
+    { "simulation.object_min",
+      "The lower corner of the box the resting objects are placed in.",
+      [](Config& c, const std::string& v) { c.objectMin = parseVec3(v); } },
+    { "simulation.object_max",
+      "The upper corner of the box the resting objects are placed in.",
+      [](Config& c, const std::string& v) { c.objectMax = parseVec3(v); } },
+    { "simulation.object_spacing",
+      "The least distance between the origins of any two objects.",
+      [](Config& c, const std::string& v) { c.objectSpacing = parsePositive(v); } },
+
+    { "render.spp",
+      "The samples per pixel of the reference color image.",
+      [](Config& c, const std::string& v) { c.sampling.referenceSpp = parseCount(v, 1); } },
+    { "render.noisy_spp",
+      "The samples per pixel of each noisy image, as a list.",
+      [](Config& c, const std::string& v) {
+        c.sampling.noisySpp.clear();
+        for (const auto& word : split(v))
+          c.sampling.noisySpp.emplace_back(parseCount(word, 1));
+        if (c.sampling.noisySpp.empty())
+          throw std::runtime_error("Expected at least one sample count.");
+      } },
+    { "render.shared",
+      "Whether the noisy images are snapshots of the reference image.",
+      [](Config& c, const std::string& v) { c.sampling.shared = parseBool(v); } },
+    { "render.adaptive_error",
+      "The relative error at which adaptive sampling stops a pixel, 0 to disable it.",
+      [](Config& c, const std::string& v) { c.sampling.adaptiveError = parseNumber<float>(v); } },
+    { "render.adaptive_min_spp",
+      "The fewest samples a pixel takes with adaptive sampling.",
+      [](Config& c, const std::string& v) { c.sampling.adaptiveMinSpp = parseCount(v, 1); } },
+    { "render.bounces",
+      "The maximum number of bounces of a path.",
+      [](Config& c, const std::string& v) { c.maxDepth = parseCount(v, 1); } },
+    { "render.mode",
+      "depth_first or wavefront.",
+      [](Config& c, const std::string& v) {
+        c.mode = parseEnum<Renderer::Mode>(
+          v, { { "depth_first", Renderer::Mode::DepthFirst }, { "wavefront", Renderer::Mode::Wavefront } });
+      } },
+    { "render.bvh_quality",
+      "low, medium or high: the builder of the scene BVH, when moving objects have degraded it enough.",
+      [](Config& c, const std::string& v) {
+        c.bvhQuality = parseEnum<Scene::Quality>(
+          v, { { "low", Scene::Quality::Low }, { "medium", Scene::Quality::Medium }, { "high", Scene::Quality::High } });
+      } },
+
+    { "output.format",
+      "png, exr, pfm or shards.",
+      [](Config& c, const std::string& v) {
+        c.format = parseEnum<OutputFormat>(v,
+                                           { { "png", OutputFormat::Png },
+                                             { "exr", OutputFormat::Exr },
+                                             { "pfm", OutputFormat::Pfm },
+                                             { "shards", OutputFormat::Shards } });
+      } },
+    { "output.buffers",
+      "The outputs to write, as a list of noisy, color, albedo, normal, depth, segmentation, stencil, annotation, "
+      "instance_id, masks or all.",
+      [](Config& c, const std::string& v) { c.outputs = parseOutputs(v); } },
+    { "output.project_boxes",
+      "Whether annotations are projected from the object models instead of rendered.",
+      [](Config& c, const std::string& v) { c.projectBoxes = parseBool(v); } },
+    { "output.png_encoder",
+      "stb or fast.",
+      [](Config& c, const std::string& v) {
+        c.png.encoder = parseEnum<PngOptions::Encoder>(
+          v, { { "stb", PngOptions::Encoder::Stb }, { "fast", PngOptions::Encoder::Fast } });
+      } },
+    { "output.png_level",
+      "The PNG compression level, 0 to store.",
+      [](Config& c, const std::string& v) { c.png.compressionLevel = parseCount(v, 0); } },
+    { "output.png_filter",
+      "The PNG filter, -1 to pick one per row.",
+      [](Config& c, const std::string& v) { c.png.filter = parseCount(v, -1); } },
+
+    { "models.cache",
+      "A folder to cache the decoded models and their BVHs in, so that later runs start faster.",
+      [](Config& c, const std::string& v) { c.modelCache = trim(v); } },
+    { "models.crease_angle",
+      "Faces meeting at a smaller angle than this, in degrees, are shaded smoothly. 0 keeps every face flat.",
+      [](Config& c, const std::string& v) { c.creaseAngle = parseNumber<float>(v); } },
+    { "models.static",
+      "A model of the room, as 'path [r g b [r g b]]' (albedo, emission). May be repeated.",
+      [](Config& c, const std::string& v) { c.staticModels.emplace_back(parseModel(v)); } },
+    { "models.object",
+      "A model that may be dropped, as 'path [r g b [r g b]]'. May be repeated.",
+      [](Config& c, const std::string& v) { c.objectModels.emplace_back(parseModel(v)); } },
+  };
+
+  return table;
+}
+
+// Looks up a full name, or a key alone if exactly one section has it.
+const Key*
+findKey(const std::string& name)
+{
+  const Key* found{ nullptr };
+
+  for (const auto& key : keys()) {
+
+    if (name == key.name)
+      return &key;
+
+    const auto* dot = std::strchr(key.name, '.');
+
+    if (name == (dot + 1)) {
+      if (found)
+        throw std::runtime_error("'" + name + "' is ambiguous, use the full name.");
+      found = &key;
+    }
+  }
+
+  return found;
+}
+
+} // namespace
+
+void
+setConfigValue(Config& config, const std::string& name, const std::string& value)
+{
+  const auto* key = findKey(name);
+
+  if (!key)
+    throw std::runtime_error("Unknown option '" + name + "'.");
+
+  try {
+    key->set(config, value);
+  } catch (const std::runtime_error& e) {
+    throw std::runtime_error(std::string(key->name) + ": " + e.what());
+  }
+}
+
+void
+loadConfigFile(Config& config, const std::string& path)
+{
+  std::ifstream file(path);
+
+  if (!file)
+    throw std::runtime_error("Failed to open '" + path + "'.");
+
+  std::string section;
+
+  int lineNumber{ 0 };
+
+  for (std::string line; std::getline(file, line);) {
+
+    lineNumber++;
+
+    const auto comment = findComment(line);
+
+    line = trim(line.substr(0, comment));
+
+    if (line.empty())
+      continue;
+
+    const auto where = path + ":" + std::to_string(lineNumber) + ": ";
+
+    if (line.front() == '[') {
+      if (line.back() != ']')
+        throw std::runtime_error(where + "Expected ']'.");
+      section = trim(line.substr(1, line.size() - 2));
+      continue;
+    }
+
+    const auto equal = line.find('=');
+
+    if (equal == std::string::npos)
+      throw std::runtime_error(where + "Expected 'key = value'.");
+
+    const auto key = trim(line.substr(0, equal));
+
+    try {
+      setConfigValue(config, section.empty() ? key : (section + "." + key), trim(line.substr(equal + 1)));
+    } catch (const std::runtime_error& e) {
+      throw std::runtime_error(where + e.what());
+    }
+  }
+}
+
+bool
+parseCommandLine(Config& config, const int argc, char** argv)
+{
+  std::vector<std::pair<std::string, std::string>> values;
+
+  for (int i = 1; i < argc; i++) {
+
+    const std::string arg(argv[i]);
+
+    if ((arg == "--help") || (arg == "-h"))
+      return false;
+
+    if ((arg.size() < 3) || (arg.compare(0, 2, "--") != 0))
+      throw std::runtime_error("Unexpected argument '" + arg + "'.");
+
+    const auto equal = arg.find('=');
+
+    auto name = arg.substr(2, equal == std::string::npos ? std::string::npos : equal - 2);
+
+    std::replace(name.begin(), name.end(), '-', '_');
+
+    std::string value;
+
+    if (equal != std::string::npos) {
+      value = arg.substr(equal + 1);
+    } else if ((i + 1) < argc) {
+      value = argv[++i];
+    } else {
+      throw std::runtime_error("Missing a value for '" + arg + "'.");
+    }
+
+    if (name == "config")
+      loadConfigFile(config, value);
+    else
+      values.emplace_back(name, value);
+  }
+
+  for (const auto& [name, value] : values)
+    setConfigValue(config, name, value);
+
+  validateConfig(config);
+
+  return true;
+}
+
+void
+validateConfig(const Config& config)
+{
+  if (config.dt > config.duration)
+    throw std::runtime_error("simulation.dt: A step longer than simulation.duration leaves no frames.");
+
+  for (int axis = 0; axis < 3; axis++) {
+    if (config.objectMin[axis] > config.objectMax[axis])
+      throw std::runtime_error("simulation.object_max: The box ends before simulation.object_min.");
+  }
+
+  if (config.trainingCount > config.simulationCount) {
+    throw std::runtime_error("run.training: '" + std::to_string(config.trainingCount) +
+                             "' is more than run.simulations ('" + std::to_string(config.simulationCount) + "').");
+  }
+}
+
+std::string
+configHelp()
+{
+  std::ostringstream stream;
+
+  stream << "  --config <path>\n      An INI file of the options below, applied before the other flags.\n";
+
+  for (const auto& key : keys())
+    stream << "  --" << key.name << " <value>\n      " << key.help << '\n';
+
+  return stream.str();
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "image.h"
+#include "renderer.h"
+#include "scene.h"
+
+#include <bvh/v2/vec.h>
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+enum class OutputFormat
+{
+  // One PNG per image and a text file per annotation.
+  Png,
+  // Like Png, but the color images are written as linear float OpenEXR files, and the depth image holds
+  // the distance in scene units instead of a color ramp.
+  Exr,
+  // Like Exr, with PFM files.
+  Pfm,
+  // Every image and annotation of a folder packed into shard files (see shard.h).
+  Shards
+};
+
+// The outputs of a frame, as bits of Config::outputs.
+enum Output : std::uint32_t
+{
+  OutputNoisy = 1 << 0,
+  OutputColor = 1 << 1,
+  OutputAlbedo = 1 << 2,
+  OutputNormal = 1 << 3,
+  OutputDepth = 1 << 4,
+  OutputSegmentation = 1 << 5,
+  OutputStencil = 1 << 6,
+  OutputAnnotation = 1 << 7,
+  OutputInstanceId = 1 << 8,
+  OutputMasks = 1 << 9,
+  OutputAll = (1 << 10) - 1
+};
+
+struct ModelConfig final
+{
+  // Relative paths are relative to the models folder of the repository.
+  std::string path;
+
+  // A color is picked at random when none is given.
+  bool hasAlbedo{ false };
+
+  bvh::v2::Vec<float, 3> albedo{ 1, 1, 1 };
+
+  bvh::v2::Vec<float, 3> emission{ 0, 0, 0 };
+};
+
+// Everything about a run that can be changed without recompiling.
+//
+// Each value has a name of the form 'section.key', which is set either from an INI file:
+//
+//   [render]
+//   spp = 64
+//
+// or from the command line as '--render.spp=64', '--render.spp 64', or '--spp 64' when the key alone is
+// unambiguous. See configHelp() for the full list.
+struct Config final
+{
+  using Vec3 = bvh::v2::Vec<float, 3>;
+
+  int width{ 256 };
+
+  int height{ 256 };
+
+  int seed{ 1234 };
+
+  // Zero uses every hardware thread.
+  std::size_t threads{ 0 };
+
+  bool pinThreads{ false };
+
+  // The simulations with an index in [first, last) are run, 'concurrency' of them at a time.
+  std::size_t first{ 0 };
+
+  std::size_t last{ std::numeric_limits<std::size_t>::max() };
+
+  std::size_t concurrency{ 1 };
+
+  std::size_t simulationCount{ 100 };
+
+  // The first simulations go to the training set, the rest to the test set.
+  std::size_t trainingCount{ 80 };
+
+  // The length of a simulation, and the time between its frames.
+  float duration{ 3.12984f };
+
+  float dt{ 1.0f / 15.0f };
+
+  // The camera is placed uniformly at random in this box.
+  Vec3 cameraMin{ -40, 4, -2 };
+
+  Vec3 cameraMax{ -25, 6, 2 };
+
+  // The dropped object, and as many more minus one resting on the floor.
+  int objectCount{ 1 };
+
+  // The resting objects are placed in this box, at least objectSpacing apart.
+  Vec3 objectMin{ -8, 0, -8 };
+
+  Vec3 objectMax{ 8, 0, 8 };
+
+  float objectSpacing{ 4.5f };
+
+  Renderer::Sampling sampling;
+
+  Renderer::Mode mode{ Renderer::Mode::DepthFirst };
+
+  int maxDepth{ 5 };
+
+  // See Scene::commit.
+  Scene::Quality bvhQuality{ Scene::Quality::High };
+
+  OutputFormat format{ OutputFormat::Png };
+
+  std::uint32_t outputs{ OutputAll };
+
+  // Whether the annotations come from projecting the objects' models instead of from the rendered pixels.
+  // Projected boxes need no rendering, but they include the hidden parts of an object.
+  bool projectBoxes{ false };
+
+  PngOptions png;
+
+  // Where the decoded models and their BVHs are cached between runs (see Scene::setCacheDirectory).
+  std::string modelCache;
+
+  // See Scene::setCreaseAngle.
+  float creaseAngle{ 30.0f };
+
+  // Empty lists stand for the built in scene.
+  std::vector<ModelConfig> staticModels;
+
+  std::vector<ModelConfig> objectModels;
+};
+
+// These throw std::runtime_error naming the offending key or line when a value cannot be used.
+
+void
+setConfigValue(Config& config, const std::string& name, const std::string& value);
+
+void
+loadConfigFile(Config& config, const std::string& path);
+
+// Applies '--config <path>' (which may be repeated) and then every other flag, so that flags override files, and
+// validates the result. Returns false if '--help' was given.
+bool
+parseCommandLine(Config& config, int argc, char** argv);
+
+// Checks the values that depend on each other, which the keys can not check one at a time.
+void
+validateConfig(const Config& config);
+
+std::string
+configHelp();
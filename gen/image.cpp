@@ -1,29 +1,143 @@
 #include "image.h"
 
+#include "png_encoder.h"
+
 #include "third_party/stb_image_write.h"
 
 #include <algorithm>
+#include <bit>
+#include <new>
+#include <string>
 
-namespace {
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 
-template<typename T>
-auto
-min(const bvh::v2::Vec<T, 3>& a, const bvh::v2::Vec<T, 3>& b) -> bvh::v2::Vec<T, 3>
+BufferPool::BufferPool()
+  : m_state(std::make_shared<State>())
 {
-  return { std::min(a[0], b[0]), std::min(a[1], b[1]), std::min(a[2], b[2]) };
 }
 
-template<typename T>
 auto
-max(const bvh::v2::Vec<T, 3>& a, const bvh::v2::Vec<T, 3>& b) -> bvh::v2::Vec<T, 3>
+BufferPool::acquire(BufferPool* pool, const std::size_t size) -> Buffer
+{
+  // Empty images hold no memory at all.
+  if (size == 0)
+    return Buffer(nullptr, Release{ nullptr, 0 });
+
+  std::byte* data{ nullptr };
+
+  std::shared_ptr<State> state;
+
+  if (pool) {
+
+    state = pool->m_state;
+
+    std::lock_guard<std::mutex> lock(state->mutex);
+
+    auto it = std::find_if(state->free.begin(), state->free.end(), [size](const auto& b) { return b.first == size; });
+
+    if (it != state->free.end()) {
+      data = it->second;
+      *it = state->free.back();
+      state->free.pop_back();
+    }
+  }
+
+  if (!data)
+    data = static_cast<std::byte*>(::operator new(std::max<std::size_t>(size, 1), std::align_val_t(alignment)));
+
+  std::memset(data, 0, size);
+
+  return Buffer(data, Release{ std::move(state), size });
+}
+
+void
+BufferPool::Release::operator()(std::byte* data) const
+{
+  if (!state) {
+    ::operator delete(data, std::align_val_t(alignment));
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(state->mutex);
+
+  state->free.emplace_back(size, data);
+}
+
+BufferPool::State::~State()
+{
+  for (const auto& b : free)
+    ::operator delete(b.second, std::align_val_t(alignment));
+}
+
+namespace {
+
+// The byte buffer an image is converted into before it is encoded, kept around for the next image.
+thread_local std::vector<unsigned char> scratch;
+
+// The encoded file, kept around for the next image as well.
+thread_local std::vector<unsigned char> encoded;
+
+PngOptions png_options;
+
+unsigned char
+toByte(const float c)
+{
+  return static_cast<unsigned char>(static_cast<int>(std::min(std::max(c * 255.0f, 0.0f), 255.0f)));
+}
+
+bool
+encodePixels(const unsigned char* pixels, const int w, const int h, const int channels, std::vector<unsigned char>& out)
+{
+  if ((w <= 0) || (h <= 0))
+    return false;
+
+  if ((png_options.encoder == PngOptions::Encoder::Fast) || (png_options.compressionLevel <= 0))
+    return encodeFastPng(pixels, w, h, channels, png_options.compressionLevel, png_options.filter, out);
+
+  out.clear();
+
+  auto append = [](void* context, void* data, int size) {
+    auto& bytes = *static_cast<std::vector<unsigned char>*>(context);
+    bytes.insert(bytes.end(), static_cast<unsigned char*>(data), static_cast<unsigned char*>(data) + size);
+  };
+
+  return !!stbi_write_png_to_func(append, &out, w, h, channels, pixels, w * channels);
+}
+
+bool
+writeFile(const std::vector<unsigned char>& data, const char* path)
 {
-  return { std::max(a[0], b[0]), std::max(a[1], b[1]), std::max(a[2], b[2]) };
+  auto* file = std::fopen(path, "wb");
+  if (!file)
+    return false;
+
+  const auto written = std::fwrite(data.data(), 1, data.size(), file);
+
+  return (std::fclose(file) == 0) && (written == data.size());
 }
 
 } // namespace
 
+void
+setPngOptions(const PngOptions& options)
+{
+  png_options = options;
+
+  stbi_write_png_compression_level = options.compressionLevel;
+
+  stbi_write_force_png_filter = options.filter;
+}
+
+const PngOptions&
+pngOptions()
+{
+  return png_options;
+}
+
 bool
-savePng(const Image<bvh::v2::Vec<float, 3>>& image, const char* path)
+encodePng(const Image<bvh::v2::Vec<float, 3>>& image, std::vector<unsigned char>& out)
 {
   const int w = image.width();
   const int h = image.height();
@@ -31,34 +145,218 @@ savePng(const Image<bvh::v2::Vec<float, 3>>& image, const char* path)
   if ((w <= 0) || (h <= 0))
     return false;
 
-  using Vec3 = bvh::v2::Vec<float, 3>;
-
-  std::unique_ptr<unsigned char[]> data(new unsigned char[w * h * 3]);
+  const auto pixels = static_cast<std::size_t>(w) * static_cast<std::size_t>(h);
 
-  for (int i = 0; i < w * h; i++) {
+  scratch.resize(pixels * 3);
 
-    const auto c = image[i];
+  auto* data = scratch.data();
 
-    const auto safe_c = min(max(c * 255.0f, Vec3(0, 0, 0)), Vec3(255, 255, 255));
+  for (int c = 0; c < 3; c++) {
 
-    auto* pixel = data.get() + i * 3;
+    const auto* plane = image.plane(c);
 
-    pixel[0] = static_cast<unsigned char>(static_cast<int>(safe_c[0]));
-    pixel[1] = static_cast<unsigned char>(static_cast<int>(safe_c[1]));
-    pixel[2] = static_cast<unsigned char>(static_cast<int>(safe_c[2]));
+    for (std::size_t i = 0; i < pixels; i++)
+      data[i * 3 + c] = toByte(plane[i]);
   }
 
-  return !!stbi_write_png(path, w, h, 3, data.get(), w * 3);
+  return encodePixels(data, w, h, 3, out);
+}
+
+bool
+encodePng(const Image<unsigned char>& image, std::vector<unsigned char>& out)
+{
+  return encodePixels(image.data(), image.width(), image.height(), 1, out);
+}
+
+bool
+savePng(const Image<bvh::v2::Vec<float, 3>>& image, const char* path)
+{
+  return encodePng(image, encoded) && writeFile(encoded, path);
 }
 
 bool
 savePng(const Image<unsigned char>& image, const char* path)
 {
-  const int w = image.width();
-  const int h = image.height();
+  return encodePng(image, encoded) && writeFile(encoded, path);
+}
+
+namespace {
+
+// The PFM and OpenEXR writers copy floats and integers as the host stores them, while both formats are written
+// as little endian.
+static_assert(std::endian::native == std::endian::little, "The PFM and OpenEXR writers need a little endian host.");
+
+bool
+writePfm(const int w, const int h, const std::vector<const float*>& planes, const char* path)
+{
+  if ((w <= 0) || (h <= 0))
+    return false;
+
+  const auto channels = planes.size();
+
+  std::string header = (channels == 3) ? "PF\n" : "Pf\n";
+
+  // A negative scale marks the data as little endian, and rows go from the bottom up.
+  header += std::to_string(w) + ' ' + std::to_string(h) + "\n-1.0\n";
+
+  encoded.assign(header.begin(), header.end());
+
+  const auto row_size = static_cast<std::size_t>(w) * channels * sizeof(float);
+
+  encoded.resize(header.size() + row_size * h);
+
+  auto* out = reinterpret_cast<float*>(encoded.data() + header.size());
+
+  for (int y = h - 1; y >= 0; y--) {
+    for (int x = 0; x < w; x++) {
+      for (std::size_t c = 0; c < channels; c++)
+        *out++ = planes[c][y * w + x];
+    }
+  }
+
+  return writeFile(encoded, path);
+}
+
+template<typename T>
+void
+append(std::vector<unsigned char>& out, const T& value)
+{
+  const auto* bytes = reinterpret_cast<const unsigned char*>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
 
+void
+appendAttribute(std::vector<unsigned char>& out,
+                const char* name,
+                const char* type,
+                const std::vector<unsigned char>& value)
+{
+  out.insert(out.end(), name, name + std::strlen(name) + 1);
+  out.insert(out.end(), type, type + std::strlen(type) + 1);
+  append(out, static_cast<std::int32_t>(value.size()));
+  out.insert(out.end(), value.begin(), value.end());
+}
+
+// Writes an uncompressed, single part scanline OpenEXR file whose channels are 32 bit, either floats (pixel type 2)
+// or unsigned integers (pixel type 0). The channels must be given in alphabetical order, as the format requires.
+bool
+writeExr(const int w,
+         const int h,
+         const std::vector<std::pair<const char*, const void*>>& channels,
+         const std::int32_t pixelType,
+         const char* path)
+{
   if ((w <= 0) || (h <= 0))
     return false;
 
-  return !!stbi_write_png(path, w, h, 1, &image[0], w);
+  encoded.clear();
+
+  const unsigned char magic[]{ 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+
+  encoded.insert(encoded.end(), magic, magic + sizeof(magic));
+
+  std::vector<unsigned char> value;
+
+  for (const auto& channel : channels) {
+    value.insert(value.end(), channel.first, channel.first + std::strlen(channel.first) + 1);
+    append(value, pixelType);
+    append(value, std::int32_t(0)); // pLinear and reserved bytes
+    append(value, std::int32_t(1)); // x sampling
+    append(value, std::int32_t(1)); // y sampling
+  }
+
+  value.push_back(0);
+
+  appendAttribute(encoded, "channels", "chlist", value);
+
+  appendAttribute(encoded, "compression", "compression", { 0 });
+
+  value.clear();
+  append(value, std::int32_t(0));
+  append(value, std::int32_t(0));
+  append(value, std::int32_t(w - 1));
+  append(value, std::int32_t(h - 1));
+
+  appendAttribute(encoded, "dataWindow", "box2i", value);
+
+  appendAttribute(encoded, "displayWindow", "box2i", value);
+
+  appendAttribute(encoded, "lineOrder", "lineOrder", { 0 });
+
+  value.clear();
+  append(value, 1.0f);
+
+  appendAttribute(encoded, "pixelAspectRatio", "float", value);
+
+  value.clear();
+  append(value, 0.0f);
+  append(value, 0.0f);
+
+  appendAttribute(encoded, "screenWindowCenter", "v2f", value);
+
+  value.clear();
+  append(value, 1.0f);
+
+  appendAttribute(encoded, "screenWindowWidth", "float", value);
+
+  encoded.push_back(0);
+
+  // The offset table points at every scanline, each of which holds its channels one after the other.
+
+  const auto line_size = static_cast<std::size_t>(w) * channels.size() * sizeof(float);
+
+  const auto first_line = encoded.size() + sizeof(std::uint64_t) * h;
+
+  for (int y = 0; y < h; y++)
+    append(encoded, static_cast<std::uint64_t>(first_line + (line_size + 8) * y));
+
+  for (int y = 0; y < h; y++) {
+
+    append(encoded, static_cast<std::int32_t>(y));
+
+    append(encoded, static_cast<std::int32_t>(line_size));
+
+    for (const auto& channel : channels) {
+      const auto* row = static_cast<const unsigned char*>(channel.second) + line_size / channels.size() * y;
+      encoded.insert(encoded.end(), row, row + line_size / channels.size());
+    }
+  }
+
+  return writeFile(encoded, path);
+}
+
+} // namespace
+
+bool
+savePfm(const Image<bvh::v2::Vec<float, 3>>& image, const char* path)
+{
+  return writePfm(image.width(), image.height(), { image.plane(0), image.plane(1), image.plane(2) }, path);
+}
+
+bool
+savePfm(const Image<float>& image, const char* path)
+{
+  return writePfm(image.width(), image.height(), { image.data() }, path);
+}
+
+bool
+saveExr(const Image<bvh::v2::Vec<float, 3>>& image, const char* path)
+{
+  const std::vector<std::pair<const char*, const void*>> channels{ { "B", image.plane(2) },
+                                                                   { "G", image.plane(1) },
+                                                                   { "R", image.plane(0) } };
+
+  return writeExr(image.width(), image.height(), channels, 2, path);
+}
+
+bool
+saveExr(const Image<float>& image, const char* path)
+{
+  return writeExr(image.width(), image.height(), { { "Z", image.data() } }, 2, path);
+}
+
+bool
+saveExr(const Image<std::uint32_t>& image, const char* path)
+{
+  return writeExr(image.width(), image.height(), { { "id", image.data() } }, 0, path);
 }
@@ -3,13 +3,119 @@
 #include <bvh/v2/vec.h>
 
 #include <memory>
+#include <mutex>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+// Hands out zeroed, 64 byte aligned blocks of memory and keeps the ones that are released, so that images
+// of the same size can be allocated frame after frame without going back to the system allocator.
+class BufferPool final
+{
+  struct State;
+
+public:
+  static constexpr std::size_t alignment{ 64 };
+
+  struct Release final
+  {
+    std::shared_ptr<State> state;
+
+    std::size_t size;
+
+    void operator()(std::byte* data) const;
+  };
+
+  using Buffer = std::unique_ptr<std::byte[], Release>;
+
+  BufferPool();
+
+  // Allocates a buffer of at least 'size' bytes. Without a pool, the buffer is freed when released.
+  static Buffer acquire(BufferPool* pool, std::size_t size);
+
+private:
+  struct State final
+  {
+    std::mutex mutex;
+
+    std::vector<std::pair<std::size_t, std::byte*>> free;
+
+    ~State();
+  };
+
+  std::shared_ptr<State> m_state;
+};
 
 template<typename T>
 class Image final
 {
 public:
-  Image(const int w, const int h)
-    : m_color(new T[w * h]{})
+  Image(const int w, const int h, BufferPool* pool = nullptr)
+    : m_buffer(BufferPool::acquire(pool, sizeof(T) * w * h))
+    , m_width(w)
+    , m_height(h)
+  {
+  }
+
+  int width() const { return m_width; }
+
+  int height() const { return m_height; }
+
+  T* data() { return reinterpret_cast<T*>(m_buffer.get()); }
+
+  const T* data() const { return reinterpret_cast<const T*>(m_buffer.get()); }
+
+  T& operator[](const int index) { return data()[index]; }
+
+  const T& operator[](const int index) const { return data()[index]; }
+
+private:
+  BufferPool::Buffer m_buffer;
+  const int m_width;
+  const int m_height;
+};
+
+// Color images are stored as three separate float planes, each starting on a 64 byte boundary,
+// so that the writers can convert them with plain vector loops.
+template<>
+class Image<bvh::v2::Vec<float, 3>> final
+{
+public:
+  using Vec3 = bvh::v2::Vec<float, 3>;
+
+  class Pixel final
+  {
+  public:
+    Pixel(float* r, const std::size_t stride)
+      : m_r(r)
+      , m_stride(stride)
+    {
+    }
+
+    Pixel(const Pixel&) = default;
+
+    // Assigning one pixel to another copies the color, as it would with plain Vec3 pixels.
+    Pixel& operator=(const Pixel& other) { return *this = static_cast<Vec3>(other); }
+
+    Pixel& operator=(const Vec3& c)
+    {
+      m_r[0] = c[0];
+      m_r[m_stride] = c[1];
+      m_r[2 * m_stride] = c[2];
+      return *this;
+    }
+
+    operator Vec3() const { return Vec3(m_r[0], m_r[m_stride], m_r[2 * m_stride]); }
+
+  private:
+    float* m_r;
+    std::size_t m_stride;
+  };
+
+  Image(const int w, const int h, BufferPool* pool = nullptr)
+    : m_stride(planeStride(w, h))
+    , m_buffer(BufferPool::acquire(pool, sizeof(float) * m_stride * 3))
     , m_width(w)
     , m_height(h)
   {
@@ -19,18 +125,90 @@ public:
 
   int height() const { return m_height; }
 
-  T& operator[](const int index) { return m_color.get()[index]; }
+  float* plane(const int channel) { return reinterpret_cast<float*>(m_buffer.get()) + m_stride * channel; }
+
+  const float* plane(const int channel) const
+  {
+    return reinterpret_cast<const float*>(m_buffer.get()) + m_stride * channel;
+  }
+
+  Pixel operator[](const int index) { return Pixel(plane(0) + index, m_stride); }
 
-  const T& operator[](const int index) const { return m_color.get()[index]; }
+  Vec3 operator[](const int index) const
+  {
+    const auto* r = plane(0) + index;
+    return Vec3(r[0], r[m_stride], r[2 * m_stride]);
+  }
 
 private:
-  std::unique_ptr<T[]> m_color;
+  static std::size_t planeStride(const int w, const int h)
+  {
+    constexpr auto floats_per_line = BufferPool::alignment / sizeof(float);
+    const auto pixels = static_cast<std::size_t>(w) * static_cast<std::size_t>(h);
+    return ((pixels + floats_per_line - 1) / floats_per_line) * floats_per_line;
+  }
+
+  std::size_t m_stride;
+  BufferPool::Buffer m_buffer;
   const int m_width;
   const int m_height;
 };
 
+struct PngOptions final
+{
+  enum class Encoder
+  {
+    // stb_image_write, which compresses best.
+    Stb,
+    // The faster encoder in png_encoder.h.
+    Fast
+  };
+
+  Encoder encoder{ Encoder::Stb };
+
+  // The zlib level of stb's encoder (it uses at least 5). Zero stores the filtered rows uncompressed,
+  // which always goes through the fast encoder.
+  int compressionLevel{ 8 };
+
+  // -1 picks the best PNG filter per row, 0 to 4 forces one.
+  int filter{ -1 };
+};
+
+// Sets how the PNG images are encoded. Not thread safe, so call it before any image is written.
+void
+setPngOptions(const PngOptions& options);
+
+const PngOptions&
+pngOptions();
+
+bool
+encodePng(const Image<bvh::v2::Vec<float, 3>>& image, std::vector<unsigned char>& out);
+
+bool
+encodePng(const Image<unsigned char>& image, std::vector<unsigned char>& out);
+
 bool
 savePng(const Image<bvh::v2::Vec<float, 3>>& image, const char* path);
 
 bool
 savePng(const Image<unsigned char>& image, const char* path);
+
+// Linear float outputs, which keep the HDR radiance and the raw depth that savePng clamps and quantizes.
+// PFM is the simplest format to parse, uncompressed scanline OpenEXR is the one most tools read.
+
+bool
+savePfm(const Image<bvh::v2::Vec<float, 3>>& image, const char* path);
+
+bool
+savePfm(const Image<float>& image, const char* path);
+
+bool
+saveExr(const Image<bvh::v2::Vec<float, 3>>& image, const char* path);
+
+// Written as a single 'Z' channel.
+bool
+saveExr(const Image<float>& image, const char* path);
+
+// Written as a single unsigned integer 'id' channel, which keeps every bit of the IDs.
+bool
+saveExr(const Image<std::uint32_t>& image, const char* path);
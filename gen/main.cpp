@@ -1,19 +1,28 @@
+#include "affinity.h"
 #include "color_generator.h"
+#include "config.h"
 #include "image.h"
 #include "renderer.h"
+#include "sampler.h"
 #include "scene.h"
+#include "shard.h"
+#include "write_queue.h"
 
 #include <glm/gtx/transform.hpp>
 
 #include <bvh/v2/vec.h>
 
 #include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
 
 #include <cmath>
 #include <cstdlib>
@@ -32,25 +41,23 @@ createDataPath(const char* folderPath, const char* name, const int i, const char
   return imagePathStream.str();
 }
 
-struct ModelInfo final
-{
-  std::string path;
-
-  bvh::v2::Vec<float, 3> albedo;
-
-  bvh::v2::Vec<float, 3> emission;
-};
-
 class Program final
 {
 public:
   using Vec3 = bvh::v2::Vec<float, 3>;
 
-  Program(const int w, const int h, const int seed)
-    : m_colorGenerator(seed)
-    , m_renderer(w, h, seed)
-    , m_rng(seed)
+  explicit Program(const Config& config)
+    : m_config(config)
+    , m_stepsPerSimulation(static_cast<int>(config.duration / config.dt))
+    , m_renderBuffers(renderBuffers(config.outputs, config.projectBoxes))
+    , m_threadPool(config.threads)
+    , m_colorGenerator(config.seed)
+    , m_scene(m_threadPool)
   {
+    m_scene.setCacheDirectory(config.modelCache);
+
+    m_scene.setCreaseAngle(config.creaseAngle);
+
     loadModels();
 
     if (!std::filesystem::exists("train"))
@@ -60,25 +67,117 @@ public:
       std::filesystem::create_directory("test");
   }
 
+  // Runs the simulations with an index in [first, last), 'concurrency' of them at a time.
+  //
+  // Each simulation is seeded from its index alone and marks its output folder once all of its files
+  // are written, so a run can be split across processes by index range, and restarted after a crash
+  // without redoing the simulations that completed.
   void run()
   {
-    for (std::size_t i = 0; i < 80; i++) {
-      std::uniform_int_distribution<std::size_t> d(m_objectModelOffset, m_objectModelOffset + m_objectModelCount - 1);
-      const auto objectIndex{ d(m_rng) };
-      runSimulation(objectIndex, "train");
-      std::cout << "Generated training set " << i << " of 80." << std::endl;
-    }
+    const auto end = std::min(m_config.last, m_config.simulationCount);
+
+    const auto laneCount = std::max<std::size_t>(m_config.concurrency, 1);
+
+    const auto hardwareThreads = std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+
+    const auto threadCount = m_config.threads ? m_config.threads : hardwareThreads;
+
+    const auto threadsPerLane = std::max<std::size_t>(threadCount / laneCount, 1);
 
-    for (std::size_t i = 0; i < 20; i++) {
-      std::uniform_int_distribution<std::size_t> d(m_objectModelOffset, m_objectModelOffset + m_objectModelCount - 1);
-      const auto objectIndex{ d(m_rng) };
-      runSimulation(objectIndex, "test");
-      std::cout << "Generated test set " << i << " of 20." << std::endl;
+    std::atomic<std::size_t> next{ m_config.first };
+
+    std::vector<std::thread> lanes;
+
+    for (std::size_t i = 0; i < laneCount; i++) {
+      lanes.emplace_back([this, i, end, threadsPerLane, &next] {
+        Lane lane(*this, threadsPerLane);
+
+        if (m_config.pinThreads)
+          pinThreads(lane.threadPool, i * threadsPerLane);
+
+        for (auto simulation = next++; simulation < end; simulation = next++)
+          runSimulation(lane, simulation);
+      });
     }
+
+    for (auto& lane : lanes)
+      lane.join();
+
+    m_writer.wait();
   }
 
 protected:
-  void runSimulation(const std::size_t objectIndex, const char* folderPath)
+  // What one concurrently running simulation needs for itself.
+  struct Lane final
+  {
+    bvh::v2::ThreadPool threadPool;
+
+    Scene scene;
+
+    Renderer renderer;
+
+    Lane(const Program& program, const std::size_t threadCount)
+      : threadPool(threadCount)
+      , scene(threadPool, program.m_scene)
+      , renderer(program.m_config.width, program.m_config.height, program.m_config.seed, threadPool)
+    {
+      renderer.setSampling(program.m_config.sampling);
+      renderer.setMode(program.m_config.mode);
+      renderer.setMaxDepth(program.m_config.maxDepth);
+    }
+  };
+
+  // Marks a simulation as complete once the last of its outputs is written, unless one of them failed, so that
+  // the next run generates it again.
+  struct Completion final
+  {
+    std::string markerPath;
+
+    std::shared_ptr<shard::Writer> shards;
+
+    std::atomic<bool> failed{ false };
+
+    ~Completion()
+    {
+      if (shards && !shards->flush())
+        failed = true;
+
+      if (failed) {
+        std::cerr << "Failed to write some outputs, '" << markerPath << "' is not written." << std::endl;
+        return;
+      }
+
+      std::ofstream marker(markerPath.c_str());
+
+      marker << "done" << std::endl;
+
+      marker.close();
+
+      if (marker.fail()) {
+        std::error_code error;
+        std::filesystem::remove(markerPath, error);
+        std::cerr << "Failed to write '" << markerPath << "'." << std::endl;
+      }
+    }
+  };
+
+  // Everything the background writes of a frame refer to.
+  struct Frame final
+  {
+    std::shared_ptr<const Renderer::Result> result;
+
+    std::shared_ptr<Completion> completion;
+
+    const char* folderPath;
+
+    int stepIndex;
+
+    std::vector<std::string> levelNames;
+
+    bool withSampleCount;
+  };
+
+  void runSimulation(Lane& lane, const std::size_t simulation)
   {
     // Conservation of energy:
     //       mgh = (1/2)mv^2
@@ -90,39 +189,65 @@ protected:
     //
     // Total time (quadratic equation) = 3.499
 
+    const auto* folderPath = (simulation < m_config.trainingCount) ? "train" : "test";
+
+    const auto markerPath = createDataPath(folderPath, "simulation", static_cast<int>(simulation), ".done");
+
+    if (std::filesystem::exists(markerPath)) {
+      log("Skipped simulation " + std::to_string(simulation) + ", it is already complete.");
+      return;
+    }
+
+    const auto seed = static_cast<int>(
+      sampling::hashCombine(static_cast<std::uint32_t>(m_config.seed), static_cast<std::uint32_t>(simulation)));
+
+    std::mt19937 rng(static_cast<std::uint32_t>(seed));
+
+    ColorGenerator colorGenerator(seed);
+
+    auto& renderer = lane.renderer;
+
+    auto& scene = lane.scene;
+
+    renderer.setSeed(seed);
+
+    std::uniform_int_distribution<std::size_t> objectDist(m_objectModelOffset,
+                                                          m_objectModelOffset + m_objectModelCount - 1);
+
+    const auto objectIndex{ objectDist(rng) };
+
     std::uniform_int_distribution<int> skyDist(0, 2);
 
-    switch (skyDist(m_rng)) {
+    switch (skyDist(rng)) {
       case 0:
-        m_renderer.setSkyColors(0xffffff, 0x7fcfff);
+        renderer.setSkyColors(0xffffff, 0x7fcfff);
         break;
       case 1:
-        m_renderer.setSkyColors(0xe15b00, 0x7a96bc);
+        renderer.setSkyColors(0xe15b00, 0x7a96bc);
         break;
       case 2:
-        m_renderer.setSkyColors(0x182c6b, 0x010216);
+        renderer.setSkyColors(0x182c6b, 0x010216);
         break;
     }
 
-    const auto albedo = m_colorGenerator.generate();
+    const auto albedo = colorGenerator.generate();
 
-    std::uniform_real_distribution<float> camXDist(-40, -25);
-    std::uniform_real_distribution<float> camYDist(4, 6);
-    std::uniform_real_distribution<float> camZDist(-2, 2);
+    const auto& camMin = m_config.cameraMin;
+    const auto& camMax = m_config.cameraMax;
 
-    const Vec3 cameraPos(camXDist(m_rng), camYDist(m_rng), camZDist(m_rng));
+    std::uniform_real_distribution<float> camXDist(camMin[0], camMax[0]);
+    std::uniform_real_distribution<float> camYDist(camMin[1], camMax[1]);
+    std::uniform_real_distribution<float> camZDist(camMin[2], camMax[2]);
 
-    const float totalTime = 3.12984f;
+    const Vec3 cameraPos(camXDist(rng), camYDist(rng), camZDist(rng));
 
     const float initialVelocity = 15.336f;
 
-    const float angularVelocity = 360.0f * 3.0f / totalTime;
-
-    const float g = -9.8;
+    const float angularVelocity = 360.0f * 3.0f / m_config.duration;
 
-    const float dt = 1.0f / 15.0f;
+    const float dt = m_config.dt;
 
-    const int totalSteps = static_cast<int>(totalTime / dt);
+    const float g = -9.8;
 
     float velocity = initialVelocity;
 
@@ -130,11 +255,36 @@ protected:
 
     float angle = 0;
 
-    for (int i = 0; i < totalSteps; i++) {
+    auto completion = std::make_shared<Completion>();
+
+    completion->markerPath = markerPath;
+
+    if (m_config.format == OutputFormat::Shards) {
+      const auto prefix = createDataPath(folderPath, "simulation", static_cast<int>(simulation), "");
+      completion->shards = std::make_shared<shard::Writer>(prefix, m_stepsPerSimulation);
+    }
+
+    std::vector<std::string> levelNames;
+
+    for (std::size_t j = 1; j < renderer.sampling().noisySpp.size(); j++)
+      levelNames.emplace_back("noisy_" + std::to_string(renderer.sampling().noisySpp[j]));
 
-      m_scene.clear();
+    // The static models are instanced once per simulation, each frame only moves the object.
+
+    scene.clear();
+
+    scene.instanceRange(m_staticModelOffset, m_staticModelCount);
+
+    const auto objectInstance = scene.instanceSingle(objectIndex, glm::mat4(1.0f), albedo, true);
+
+    if (m_config.objectCount > 1) {
+      const Scene::Placement placement{
+        m_objectModelOffset, m_objectModelCount, m_config.objectMin, m_config.objectMax, m_config.objectSpacing
+      };
+      scene.randomize(placement, m_config.objectCount - 1, static_cast<int>(rng()));
+    }
 
-      m_scene.instanceRange(m_staticModelOffset, m_staticModelCount);
+    for (int i = 0; i < m_stepsPerSimulation; i++) {
 
       angle += angularVelocity * dt;
 
@@ -142,103 +292,394 @@ protected:
 
       velocity += g * dt;
 
-      m_scene.instanceSingle(objectIndex,
-                             glm::translate(glm::vec3(0.0f, position, 0.0f)) *
-                               glm::rotate(glm::radians(angle), glm::vec3(0, 1, 0)),
-                             albedo,
-                             true);
+      scene.setInstanceTransform(objectInstance,
+                                 glm::translate(glm::vec3(0.0f, position, 0.0f)) *
+                                   glm::rotate(glm::radians(angle), glm::vec3(0, 1, 0)));
 
-      m_scene.commit();
+      // Only the dropped object moves from one frame to the next, so this is a refit after the first frame.
+      scene.commit(m_config.bvhQuality);
 
-      const auto render_result{ m_renderer.render(m_scene, cameraPos) };
+      // The images are encoded and written in the background while the next frame renders.
+      // The result is released (and its buffers recycled) once the last of its images is written.
 
-      savePng(render_result.noisy_color, createDataPath(folderPath, "noisy", m_stepIndex, ".png").c_str());
-      savePng(render_result.color, createDataPath(folderPath, "color", m_stepIndex, ".png").c_str());
-      savePng(render_result.albedo, createDataPath(folderPath, "albedo", m_stepIndex, ".png").c_str());
-      savePng(render_result.normal, createDataPath(folderPath, "normal", m_stepIndex, ".png").c_str());
-      savePng(render_result.depth, createDataPath(folderPath, "depth", m_stepIndex, ".png").c_str());
-      savePng(render_result.segmentation, createDataPath(folderPath, "segmentation", m_stepIndex, ".png").c_str());
-      savePng(render_result.stencil, createDataPath(folderPath, "stencil", m_stepIndex, ".png").c_str());
+      auto result = std::make_shared<Renderer::Result>(renderer.render(scene, cameraPos, m_renderBuffers));
 
-      saveYolo(render_result.stencil, objectIndex, folderPath);
+      if ((m_config.outputs & OutputAnnotation) && m_config.projectBoxes)
+        result->boxes = renderer.projectBoxes(scene, cameraPos);
 
-      m_stepIndex++;
+      const Frame frame{ std::move(result),
+                         completion,
+                         folderPath,
+                         static_cast<int>(simulation) * m_stepsPerSimulation + i,
+                         levelNames,
+                         renderer.sampling().adaptiveError > 0.0f };
+
+      if (m_config.format == OutputFormat::Shards)
+        writeShardFrame(frame);
+      else
+        writeFileFrame(frame);
     }
+
+    log("Generated simulation " + std::to_string(simulation) + " (" + folderPath + ").");
+  }
+
+  void log(const std::string& message)
+  {
+    std::lock_guard<std::mutex> lock(m_logMutex);
+
+    std::cout << message << std::endl;
   }
 
-  void saveYolo(const Image<unsigned char>& stencil, const std::size_t objectIndex, const char* folderPath)
+  void writeFileFrame(const Frame& frame)
   {
-    int xMin = stencil.width() + 1;
-    int xMax = -1;
-    int yMin = stencil.height() + 1;
-    int yMax = -1;
-
-    for (int y = 0; y < stencil.height(); y++) {
-      for (int x = 0; x < stencil.width(); x++) {
-        if (!stencil[y * stencil.width() + x])
-          continue;
-        xMin = std::min(xMin, x);
-        xMax = std::max(xMax, x);
-        yMin = std::min(yMin, y);
-        yMax = std::max(yMax, y);
+    const auto format = m_config.format;
+
+    const auto outputs = m_config.outputs;
+
+    const auto* extension = (format == OutputFormat::Exr) ? ".exr" : ((format == OutputFormat::Pfm) ? ".pfm" : ".png");
+
+    const auto& result = frame.result;
+
+    auto path = [&](const std::string& name, const char* ext) {
+      return createDataPath(frame.folderPath, name.c_str(), frame.stepIndex, ext);
+    };
+
+    auto write = [&](const auto& image, const std::string& name) {
+      m_writer.push([result, completion = frame.completion, &image, format, path = path(name, extension)] {
+        if (!saveImage(image, path.c_str(), format))
+          completion->failed = true;
+      });
+    };
+
+    if (outputs & OutputNoisy) {
+      write(result->noisy_color, "noisy");
+
+      for (std::size_t j = 0; j < result->noisy_levels.size(); j++)
+        write(result->noisy_levels[j], frame.levelNames[j]);
+    }
+
+    if (outputs & OutputColor) {
+      write(result->color, "color");
+
+      if (frame.withSampleCount)
+        write(result->sample_count, "spp");
+    }
+
+    if (outputs & OutputAlbedo)
+      write(result->albedo, "albedo");
+
+    if (outputs & OutputNormal)
+      write(result->normal, "normal");
+
+    if (outputs & OutputDepth) {
+      if (format == OutputFormat::Png)
+        write(result->depth, "depth");
+      else
+        write(result->linear_depth, "depth");
+    }
+
+    if (outputs & OutputSegmentation)
+      write(result->segmentation, "segmentation");
+
+    // The stencil is a mask, which PNG stores losslessly.
+    if (outputs & OutputStencil) {
+      m_writer.push([result, completion = frame.completion, path = path("stencil", ".png")] {
+        if (!savePng(result->stencil, path.c_str()))
+          completion->failed = true;
+      });
+    }
+
+    if (outputs & OutputAnnotation) {
+      m_writer.push([frame, path = path("annotation", ".txt")] {
+        const auto annotation = yoloAnnotation(frame.result->boxes);
+        if (!annotation.empty() && !saveText(annotation, path.c_str()))
+          frame.completion->failed = true;
+      });
+    }
+
+    // The IDs need all 32 bits, so they are always written as OpenEXR.
+    if (outputs & OutputInstanceId) {
+      m_writer.push([result, completion = frame.completion, path = path("instance_id", ".exr")] {
+        if (!saveExr(result->instance_id, path.c_str()))
+          completion->failed = true;
+      });
+    }
+
+    if (outputs & OutputMasks) {
+      m_writer.push([result, completion = frame.completion, path = path("masks", ".json")] {
+        if (!saveText(cocoMasks(*result), path.c_str()))
+          completion->failed = true;
+      });
+    }
+  }
+
+  // Writes the same images as writeFileFrame, as float and byte planes of one entry per image.
+  void writeShardFrame(const Frame& frame)
+  {
+    m_writer.push([frame, outputs = m_config.outputs] {
+      const auto& result = frame.result;
+
+      shard::Writer::Frame entries;
+
+      if (outputs & OutputNoisy) {
+        entries.add("noisy", result->noisy_color);
+
+        for (std::size_t j = 0; j < frame.levelNames.size(); j++)
+          entries.add(frame.levelNames[j].c_str(), result->noisy_levels[j]);
+      }
+
+      if (outputs & OutputColor) {
+        entries.add("color", result->color);
+
+        if (frame.withSampleCount)
+          entries.add("spp", result->sample_count);
+      }
+
+      if (outputs & OutputAlbedo)
+        entries.add("albedo", result->albedo);
+
+      if (outputs & OutputNormal)
+        entries.add("normal", result->normal);
+
+      if (outputs & OutputDepth) {
+        entries.add("depth", result->depth);
+        entries.add("linear_depth", result->linear_depth);
+      }
+
+      if (outputs & OutputSegmentation)
+        entries.add("segmentation", result->segmentation);
+
+      if (outputs & OutputStencil)
+        entries.add("stencil", result->stencil);
+
+      if (outputs & OutputAnnotation) {
+        const auto annotation = yoloAnnotation(result->boxes);
+
+        if (!annotation.empty())
+          entries.add("annotation", annotation);
+      }
+
+      if (outputs & OutputInstanceId)
+        entries.add("instance_id", result->instance_id);
+
+      if (outputs & OutputMasks)
+        entries.add("masks", cocoMasks(*result));
+
+      // An exception must not escape a write job, so a shard that can not be opened fails the simulation instead.
+      try {
+        frame.completion->shards->write(static_cast<std::uint32_t>(frame.stepIndex), entries);
+      } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        frame.completion->failed = true;
+      }
+    });
+  }
+
+  // The savers return whether the file was written.
+  static bool saveImage(const Image<Vec3>& image, const char* path, const OutputFormat format)
+  {
+    if (format == OutputFormat::Exr)
+      return saveExr(image, path);
+    else if (format == OutputFormat::Pfm)
+      return savePfm(image, path);
+    else
+      return savePng(image, path);
+  }
+
+  // Float images have no PNG form, they are only written in the linear formats.
+  static bool saveImage(const Image<float>& image, const char* path, const OutputFormat format)
+  {
+    if (format == OutputFormat::Exr)
+      return saveExr(image, path);
+    else if (format == OutputFormat::Pfm)
+      return savePfm(image, path);
+
+    return true;
+  }
+
+  static bool saveText(const std::string& text, const char* path)
+  {
+    std::ofstream file(path);
+
+    file << text;
+
+    file.close();
+
+    return !file.fail();
+  }
+
+  // Returns a YOLO style line per object box (class, left, top, width and height in pixels), or nothing if
+  // no object is in view.
+  static std::string yoloAnnotation(const std::vector<Renderer::ObjectBox>& boxes)
+  {
+    std::ostringstream stream;
+
+    for (const auto& box : boxes) {
+      const int w = (box.xMax - box.xMin) + 1;
+      const int h = (box.yMax - box.yMin) + 1;
+      stream << box.classId << ' ' << box.xMin << ' ' << box.yMin << ' ' << w << ' ' << h << '\n';
+    }
+
+    return stream.str();
+  }
+
+  // Returns the masks of the objects as JSON, with the run lengths in the compressed string form of the COCO API.
+  static std::string cocoMasks(const Renderer::Result& result)
+  {
+    const auto w = result.instance_id.width();
+    const auto h = result.instance_id.height();
+
+    std::ostringstream stream;
+
+    stream << "[";
+
+    for (std::size_t i = 0; i < result.masks.size(); i++) {
+
+      const auto& mask = result.masks[i];
+
+      std::uint64_t area{ 0 };
+
+      for (std::size_t j = 1; j < mask.counts.size(); j += 2)
+        area += mask.counts[j];
+
+      stream << (i ? ",\n " : "\n ") << "{\"instance\": " << mask.instance << ", \"category_id\": " << mask.classId
+             << ", \"area\": " << area << ", \"segmentation\": {\"size\": [" << h << ", " << w
+             << "], \"counts\": \"";
+
+      // The counts are printable characters from '0' to 'o', of which only the backslash needs escaping.
+      for (const auto c : cocoCounts(mask.counts)) {
+        if (c == '\\')
+          stream << '\\';
+        stream << c;
       }
+
+      stream << "\"}}";
     }
 
-    if ((xMax < 0) || (yMax < 0))
-      return;
+    stream << "\n]\n";
+
+    return stream.str();
+  }
+
+  // Each count (after the second, as the difference to the count two before it) is written as a sequence of
+  // 5 bit groups, least significant first, offset into printable characters. See rleToString in the COCO API.
+  static std::string cocoCounts(const std::vector<std::uint32_t>& counts)
+  {
+    std::string text;
+
+    for (std::size_t i = 0; i < counts.size(); i++) {
+
+      auto x = static_cast<std::int64_t>(counts[i]);
+
+      if (i > 2)
+        x -= static_cast<std::int64_t>(counts[i - 2]);
 
-    const auto path = createDataPath(folderPath, "annotation", m_stepIndex, ".txt");
+      for (bool more = true; more;) {
+        auto c = static_cast<char>(x & 0x1f);
+        x >>= 5;
+        more = (c & 0x10) ? (x != -1) : (x != 0);
+        if (more)
+          c |= 0x20;
+        text.push_back(static_cast<char>(c + 48));
+      }
+    }
 
-    const int w = (xMax - xMin) + 1;
-    const int h = (yMax - yMin) + 1;
+    return text;
+  }
 
-    std::ofstream file(path.c_str());
+  // The images the renderer needs to produce for the outputs. Annotations come from the rendered object
+  // boxes, unless the boxes are projected.
+  static std::uint32_t renderBuffers(const std::uint32_t outputs, const bool projectBoxes)
+  {
+    std::uint32_t buffers{ 0 };
+
+    const std::pair<std::uint32_t, std::uint32_t> map[]{
+      { OutputNoisy, Renderer::BufferNoisy },
+      { OutputColor, Renderer::BufferColor },
+      { OutputAlbedo, Renderer::BufferAlbedo },
+      { OutputNormal, Renderer::BufferNormal },
+      { OutputDepth, Renderer::BufferDepth },
+      { OutputSegmentation, Renderer::BufferSegmentation },
+      { OutputStencil, Renderer::BufferStencil },
+      { projectBoxes ? 0u : static_cast<std::uint32_t>(OutputAnnotation), Renderer::BufferBoxes },
+      { OutputInstanceId, Renderer::BufferInstanceId },
+      { OutputMasks, Renderer::BufferMasks },
+    };
+
+    for (const auto& [output, buffer] : map) {
+      if (outputs & output)
+        buffers |= buffer;
+    }
 
-    file << objectIndex << ' ' << xMin << ' ' << yMin << ' ' << w << ' ' << h << std::endl;
+    return buffers;
   }
 
+  // Loads the configured models, or the built in scene for the lists that are empty.
   void loadModels()
   {
-    std::vector<ModelInfo> models;
-
-    models.emplace_back(ModelInfo{ MODEL_PATH "/room.stl", { 1, 1, 1 }, { 0, 0, 0 } });
-    models.emplace_back(ModelInfo{ MODEL_PATH "/ejection_tunnel.stl", { 0, 1, 0 }, { 0, 0, 0 } });
-    models.emplace_back(ModelInfo{ MODEL_PATH "/big_sphere.stl", m_colorGenerator.generate(), { 0, 0, 0 } });
-    models.emplace_back(ModelInfo{ MODEL_PATH "/little_sphere.stl", m_colorGenerator.generate(), { 0, 0, 0 } });
-    models.emplace_back(ModelInfo{ MODEL_PATH "/cone.stl", m_colorGenerator.generate(), { 0, 0, 0 } });
-    models.emplace_back(ModelInfo{ MODEL_PATH "/left_shelf.stl", { 0.787, 0.129, 0 }, { 0, 0, 0 } });
-    models.emplace_back(ModelInfo{ MODEL_PATH "/big_cube.stl", m_colorGenerator.generate(), { 0, 0, 0 } });
-    models.emplace_back(ModelInfo{ MODEL_PATH "/little_cube.stl", m_colorGenerator.generate(), { 0, 0, 0 } });
-    models.emplace_back(ModelInfo{ MODEL_PATH "/right_shelf.stl", { 0.787, 0.129, 0 }, { 0, 0, 0 } });
-    models.emplace_back(ModelInfo{ MODEL_PATH "/torus.stl", m_colorGenerator.generate(), { 0, 0, 0 } });
+    auto staticModels = m_config.staticModels;
+
+    if (staticModels.empty()) {
+      staticModels = { { "room.stl", true, { 1, 1, 1 } },
+                       { "ejection_tunnel.stl", true, { 0, 1, 0 } },
+                       { "big_sphere.stl" },
+                       { "little_sphere.stl" },
+                       { "cone.stl" },
+                       { "left_shelf.stl", true, { 0.787, 0.129, 0 } },
+                       { "big_cube.stl" },
+                       { "little_cube.stl" },
+                       { "right_shelf.stl", true, { 0.787, 0.129, 0 } },
+                       { "torus.stl" } };
+    }
 
-    m_staticModelOffset = 0;
+    auto objectModels = m_config.objectModels;
 
-    for (const auto& m : models) {
+    if (objectModels.empty())
+      objectModels = { { "buddha.stl" }, { "bunny.stl" }, { "dragon.stl" }, { "monkey.stl" }, { "teapot.stl" } };
 
-      if (m_scene.loadModel(m.path.c_str(), m.albedo, m.emission, m_colorGenerator.generate()))
-        std::cout << "Loaded '" << m.path << "'." << std::endl;
+    for (auto& m : staticModels) {
+      if (!m.hasAlbedo)
+        m.albedo = m_colorGenerator.generate();
     }
 
+    auto load = [this](const ModelConfig& m) {
+      const auto path = std::filesystem::path(m.path).is_absolute() ? m.path : (MODEL_PATH "/" + m.path);
+      if (m_scene.loadModel(path.c_str(), m.albedo, m.emission, m_colorGenerator.generate()))
+        std::cout << "Loaded '" << path << "'." << std::endl;
+    };
+
+    m_staticModelOffset = 0;
+
+    for (const auto& m : staticModels)
+      load(m);
+
     m_staticModelCount = m_scene.modelCount() - m_staticModelOffset;
 
     m_objectModelOffset = m_scene.modelCount();
 
-    m_scene.loadModel(MODEL_PATH "/buddha.stl", m_colorGenerator.generate(), { 0, 0, 0 }, m_colorGenerator.generate());
-    m_scene.loadModel(MODEL_PATH "/bunny.stl", m_colorGenerator.generate(), { 0, 0, 0 }, m_colorGenerator.generate());
-    m_scene.loadModel(MODEL_PATH "/dragon.stl", m_colorGenerator.generate(), { 0, 0, 0 }, m_colorGenerator.generate());
-    m_scene.loadModel(MODEL_PATH "/monkey.stl", m_colorGenerator.generate(), { 0, 0, 0 }, m_colorGenerator.generate());
-    m_scene.loadModel(MODEL_PATH "/teapot.stl", m_colorGenerator.generate(), { 0, 0, 0 }, m_colorGenerator.generate());
+    for (auto m : objectModels) {
+      if (!m.hasAlbedo)
+        m.albedo = m_colorGenerator.generate();
+      load(m);
+    }
 
     m_objectModelCount = m_scene.modelCount() - m_objectModelOffset;
+
+    if (m_objectModelCount == 0)
+      throw std::runtime_error("None of the object models could be loaded.");
   }
 
 private:
-  ColorGenerator m_colorGenerator;
+  const Config m_config;
+
+  const int m_stepsPerSimulation;
 
-  Renderer m_renderer;
+  const std::uint32_t m_renderBuffers;
 
-  std::mt19937 m_rng;
+  // Used to load the models, which the scenes of the lanes then share.
+  bvh::v2::ThreadPool m_threadPool;
+
+  ColorGenerator m_colorGenerator;
 
   Scene m_scene;
 
@@ -250,17 +691,37 @@ private:
 
   std::size_t m_objectModelCount{ 0 };
 
-  int m_stepIndex{ 0 };
+  std::mutex m_logMutex;
+
+  // Declared last, so that pending writes finish before anything else is torn down.
+  WriteQueue m_writer;
 };
 
 } // namespace
 
+// Usage: main [--config <path>] [--<option> <value>]...
+//
+// See configHelp() for the options. By default, all of the simulations are run with the built in scene.
 int
-main()
+main(int argc, char** argv)
 {
-  Program program(256, 256, 1234);
+  Config config;
 
-  program.run();
+  try {
+    if (!parseCommandLine(config, argc, argv)) {
+      std::cout << "Usage: " << argv[0] << " [--config <path>] [--<option> <value>]...\n\n" << configHelp();
+      return EXIT_SUCCESS;
+    }
+
+    setPngOptions(config.png);
+
+    Program program(config);
+
+    program.run();
+  } catch (const std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
 
   std::cout << "Done." << std::endl;
 
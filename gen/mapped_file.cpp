@@ -0,0 +1,86 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <fstream>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GEN_MMAP
+#endif
+
+MappedFile::MappedFile(const std::string& path)
+{
+#ifdef GEN_MMAP
+  const auto fd = ::open(path.c_str(), O_RDONLY);
+
+  if (fd < 0)
+    return;
+
+  struct stat info;
+
+  if ((::fstat(fd, &info) == 0) && (info.st_size > 0)) {
+    m_size = static_cast<std::size_t>(info.st_size);
+    auto* mapped = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped != MAP_FAILED) {
+      m_data = static_cast<const unsigned char*>(mapped);
+      m_mapped = true;
+    }
+  }
+
+  ::close(fd);
+#endif
+
+  if (m_mapped)
+    return;
+
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+
+  if (!file)
+    return;
+
+  // A size that can not be told, or allocated, or a short read leaves the view empty, like a file that can not be
+  // opened. A directory opens as a stream of unbounded size.
+
+  m_size = 0;
+
+  const auto size = file.tellg();
+
+  if (size < 0)
+    return;
+
+  auto* buffer = new (std::nothrow) unsigned char[std::max<std::size_t>(static_cast<std::size_t>(size), 1)];
+
+  if (!buffer)
+    return;
+
+  file.seekg(0);
+
+  file.read(reinterpret_cast<char*>(buffer), static_cast<std::streamsize>(size));
+
+  if (file.gcount() != static_cast<std::streamsize>(size)) {
+    delete[] buffer;
+    return;
+  }
+
+  m_data = buffer;
+
+  m_size = static_cast<std::size_t>(size);
+}
+
+MappedFile::~MappedFile()
+{
+  if (!m_data)
+    return;
+
+#ifdef GEN_MMAP
+  if (m_mapped)
+    ::munmap(const_cast<unsigned char*>(m_data), m_size);
+#endif
+
+  if (!m_mapped)
+    delete[] m_data;
+}
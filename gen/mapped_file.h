@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+
+#include <cstddef>
+
+// A read only view of a whole file, mapped into memory where the platform allows it and read into
+// a buffer otherwise.
+class MappedFile final
+{
+public:
+  // Leaves the view empty (and false) if the file cannot be opened.
+  explicit MappedFile(const std::string& path);
+
+  MappedFile(const MappedFile&) = delete;
+
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile();
+
+  explicit operator bool() const { return m_data != nullptr; }
+
+  const unsigned char* data() const { return m_data; }
+
+  std::size_t size() const { return m_size; }
+
+private:
+  const unsigned char* m_data{ nullptr };
+
+  std::size_t m_size{ 0 };
+
+  bool m_mapped{ false };
+};
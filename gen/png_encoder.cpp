@@ -0,0 +1,422 @@
+#include "png_encoder.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+std::uint32_t
+crc32(const unsigned char* data, const std::size_t size, std::uint32_t crc = 0)
+{
+  static const auto table = [] {
+    std::array<std::uint32_t, 256> t{};
+    for (std::uint32_t i = 0; i < 256; i++) {
+      auto c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+      t[i] = c;
+    }
+    return t;
+  }();
+
+  crc = ~crc;
+
+  for (std::size_t i = 0; i < size; i++)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+std::uint32_t
+adler32(const unsigned char* data, std::size_t size)
+{
+  std::uint32_t a{ 1 };
+  std::uint32_t b{ 0 };
+
+  // 5552 is the largest run for which the sums cannot overflow before being reduced.
+  while (size > 0) {
+    const auto run = std::min<std::size_t>(size, 5552);
+    for (std::size_t i = 0; i < run; i++) {
+      a += data[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+    data += run;
+    size -= run;
+  }
+
+  return (b << 16) | a;
+}
+
+void
+put32(std::vector<unsigned char>& out, const std::uint32_t v)
+{
+  out.push_back(static_cast<unsigned char>(v >> 24));
+  out.push_back(static_cast<unsigned char>(v >> 16));
+  out.push_back(static_cast<unsigned char>(v >> 8));
+  out.push_back(static_cast<unsigned char>(v));
+}
+
+void
+putChunk(std::vector<unsigned char>& out, const char* tag, const unsigned char* data, const std::size_t size)
+{
+  put32(out, static_cast<std::uint32_t>(size));
+
+  const auto begin = out.size();
+
+  out.insert(out.end(), tag, tag + 4);
+
+  out.insert(out.end(), data, data + size);
+
+  put32(out, crc32(out.data() + begin, size + 4));
+}
+
+class BitWriter final
+{
+public:
+  explicit BitWriter(std::vector<unsigned char>& out)
+    : m_out(out)
+  {
+  }
+
+  void put(const std::uint32_t bits, const int count)
+  {
+    m_bits |= static_cast<std::uint64_t>(bits) << m_count;
+    m_count += count;
+    while (m_count >= 8) {
+      m_out.push_back(static_cast<unsigned char>(m_bits));
+      m_bits >>= 8;
+      m_count -= 8;
+    }
+  }
+
+  void alignToByte()
+  {
+    if (m_count > 0)
+      put(0, 8 - m_count);
+  }
+
+private:
+  std::vector<unsigned char>& m_out;
+
+  std::uint64_t m_bits{ 0 };
+
+  int m_count{ 0 };
+};
+
+std::uint32_t
+reverse(std::uint32_t code, const int length)
+{
+  std::uint32_t result{ 0 };
+  for (int i = 0; i < length; i++, code >>= 1)
+    result = (result << 1) | (code & 1);
+  return result;
+}
+
+struct Code final
+{
+  std::uint16_t bits;
+
+  std::uint8_t length;
+};
+
+// The fixed Huffman code of the literal/length alphabet, bit reversed for the LSB first writer.
+const std::array<Code, 288>&
+fixedCodes()
+{
+  static const auto codes = [] {
+    std::array<Code, 288> c{};
+    for (std::uint32_t s = 0; s < 288; s++) {
+      std::uint32_t code;
+      int length;
+      if (s < 144) {
+        code = 0x30 + s;
+        length = 8;
+      } else if (s < 256) {
+        code = 0x190 + (s - 144);
+        length = 9;
+      } else if (s < 280) {
+        code = s - 256;
+        length = 7;
+      } else {
+        code = 0xc0 + (s - 280);
+        length = 8;
+      }
+      c[s] = Code{ static_cast<std::uint16_t>(reverse(code, length)), static_cast<std::uint8_t>(length) };
+    }
+    return c;
+  }();
+
+  return codes;
+}
+
+void
+putLiteral(BitWriter& writer, const unsigned char c)
+{
+  const auto& code = fixedCodes()[c];
+
+  writer.put(code.bits, code.length);
+}
+
+void
+putMatch(BitWriter& writer, const std::uint32_t length, const std::uint32_t distance)
+{
+  const auto& codes = fixedCodes();
+
+  // Length codes 257 to 284 cover lengths of 3 to 257 with 0 to 5 extra bits, 285 is exactly 258.
+
+  if (length == 258) {
+    writer.put(codes[285].bits, codes[285].length);
+  } else {
+    const auto l = length - 3;
+    if (l < 8) {
+      writer.put(codes[257 + l].bits, codes[257 + l].length);
+    } else {
+      const auto b = static_cast<std::uint32_t>(std::bit_width(l)) - 1;
+      const auto symbol = 257 + 4 * (b - 1) + ((l >> (b - 2)) & 3);
+      writer.put(codes[symbol].bits, codes[symbol].length);
+      writer.put(l & ((1u << (b - 2)) - 1), static_cast<int>(b - 2));
+    }
+  }
+
+  // Distance codes 0 to 29 are five bits each, followed by up to 13 extra bits.
+
+  const auto d = distance - 1;
+
+  if (d < 4) {
+    writer.put(reverse(d, 5), 5);
+  } else {
+    const auto b = static_cast<std::uint32_t>(std::bit_width(d)) - 1;
+    const auto symbol = 2 * b + ((d >> (b - 1)) & 1);
+    writer.put(reverse(symbol, 5), 5);
+    writer.put(d & ((1u << (b - 1)) - 1), static_cast<int>(b - 1));
+  }
+}
+
+std::uint32_t
+read32(const unsigned char* p)
+{
+  std::uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Wraps the data in a zlib stream, either stored or compressed with the fixed Huffman code.
+void
+deflate(const unsigned char* data, const std::size_t size, const int level, std::vector<unsigned char>& out)
+{
+  const auto begin = out.size();
+
+  out.push_back(0x78);
+  out.push_back(0x01);
+
+  BitWriter writer(out);
+
+  if (level == 0) {
+
+    std::size_t offset{ 0 };
+
+    do {
+      const auto run = std::min<std::size_t>(size - offset, 65535);
+      writer.put((offset + run) == size ? 1 : 0, 3);
+      writer.alignToByte();
+      writer.put(static_cast<std::uint32_t>(run), 16);
+      writer.put(static_cast<std::uint32_t>(~run & 0xffff), 16);
+      out.insert(out.end(), data + offset, data + offset + run);
+      offset += run;
+    } while (offset < size);
+
+  } else {
+
+    constexpr int hash_bits{ 15 };
+    constexpr std::size_t window{ 32768 };
+    constexpr std::size_t max_match{ 258 };
+
+    // Positions are stored one based, so that zero marks an empty slot.
+    std::vector<std::uint32_t> table(std::size_t(1) << hash_bits, 0);
+
+    writer.put(1 | (1 << 1), 3);
+
+    std::size_t i{ 0 };
+
+    while ((i + 4) <= size) {
+
+      const auto v = read32(data + i);
+
+      const auto h = (v * 2654435761u) >> (32 - hash_bits);
+
+      const auto candidate = static_cast<std::size_t>(table[h]);
+
+      table[h] = static_cast<std::uint32_t>(i + 1);
+
+      if ((candidate == 0) || ((i - (candidate - 1)) > window) || (read32(data + candidate - 1) != v)) {
+        putLiteral(writer, data[i]);
+        i++;
+        continue;
+      }
+
+      const auto* match = data + candidate - 1;
+
+      const auto limit = std::min(max_match, size - i);
+
+      std::size_t length{ 4 };
+
+      while ((length < limit) && (match[length] == data[i + length]))
+        length++;
+
+      putMatch(writer, static_cast<std::uint32_t>(length), static_cast<std::uint32_t>(data + i - match));
+
+      i += length;
+    }
+
+    for (; i < size; i++)
+      putLiteral(writer, data[i]);
+
+    // End of block.
+    writer.put(fixedCodes()[256].bits, fixedCodes()[256].length);
+  }
+
+  writer.alignToByte();
+
+  // Noisy images do not compress, and the fixed code spends 9 bits on half of the byte values.
+  // Such streams are stored instead, which bounds the output to the input size plus a few bytes per block.
+
+  const auto stored_size = 2 + size + 5 * (size / 65535 + 1);
+
+  if ((level != 0) && ((out.size() - begin) > stored_size)) {
+    out.resize(begin);
+    deflate(data, size, 0, out);
+    return;
+  }
+
+  const auto checksum = adler32(data, size);
+
+  put32(out, checksum);
+}
+
+unsigned char
+paeth(const int a, const int b, const int c)
+{
+  const auto p = a + b - c;
+  const auto pa = std::abs(p - a);
+  const auto pb = std::abs(p - b);
+  const auto pc = std::abs(p - c);
+  if ((pa <= pb) && (pa <= pc))
+    return static_cast<unsigned char>(a);
+  return static_cast<unsigned char>((pb <= pc) ? b : c);
+}
+
+void
+filterRow(const unsigned char* row, const unsigned char* prev, const int size, const int bpp, const int type, unsigned char* out)
+{
+  for (int i = 0; i < size; i++) {
+    const int a = (i >= bpp) ? row[i - bpp] : 0;
+    const int b = prev ? prev[i] : 0;
+    const int c = (prev && (i >= bpp)) ? prev[i - bpp] : 0;
+    int predictor{ 0 };
+    switch (type) {
+      case 1:
+        predictor = a;
+        break;
+      case 2:
+        predictor = b;
+        break;
+      case 3:
+        predictor = (a + b) >> 1;
+        break;
+      case 4:
+        predictor = paeth(a, b, c);
+        break;
+    }
+    out[i] = static_cast<unsigned char>(row[i] - predictor);
+  }
+}
+
+} // namespace
+
+bool
+encodeFastPng(const unsigned char* pixels,
+              const int w,
+              const int h,
+              const int channels,
+              const int level,
+              const int filter,
+              std::vector<unsigned char>& out)
+{
+  if ((w <= 0) || (h <= 0) || ((channels != 1) && (channels != 3) && (channels != 4)))
+    return false;
+
+  const auto row_size = w * channels;
+
+  // Each filtered row starts with its filter type.
+
+  std::vector<unsigned char> filtered(static_cast<std::size_t>(row_size + 1) * static_cast<std::size_t>(h));
+
+  for (int y = 0; y < h; y++) {
+
+    const auto* row = pixels + static_cast<std::size_t>(y) * row_size;
+    const auto* prev = (y > 0) ? (row - row_size) : nullptr;
+    auto* dst = filtered.data() + static_cast<std::size_t>(y) * (row_size + 1);
+
+    auto type = filter;
+
+    if ((type < 0) || (type > 4)) {
+
+      // Picks the filter whose output has the smallest sum of absolute (signed) values.
+
+      int best_sum{ -1 };
+
+      for (int t = 0; t < 5; t++) {
+        filterRow(row, prev, row_size, channels, t, dst + 1);
+        int sum{ 0 };
+        for (int i = 0; i < row_size; i++)
+          sum += std::abs(static_cast<signed char>(dst[1 + i]));
+        if ((best_sum < 0) || (sum < best_sum)) {
+          best_sum = sum;
+          type = t;
+        }
+      }
+    }
+
+    dst[0] = static_cast<unsigned char>(type);
+
+    filterRow(row, prev, row_size, channels, type, dst + 1);
+  }
+
+  std::vector<unsigned char> idat;
+
+  idat.reserve(filtered.size() / 2);
+
+  deflate(filtered.data(), filtered.size(), level, idat);
+
+  const unsigned char signature[8]{ 137, 80, 78, 71, 13, 10, 26, 10 };
+
+  const unsigned char color_type = (channels == 1) ? 0 : ((channels == 3) ? 2 : 6);
+
+  unsigned char header[13]{ 0, 0, 0, 0, 0, 0, 0, 0, 8, color_type, 0, 0, 0 };
+
+  for (int i = 0; i < 4; i++) {
+    header[i] = static_cast<unsigned char>(w >> (24 - 8 * i));
+    header[4 + i] = static_cast<unsigned char>(h >> (24 - 8 * i));
+  }
+
+  out.clear();
+
+  out.reserve(idat.size() + 64);
+
+  out.insert(out.end(), signature, signature + 8);
+
+  putChunk(out, "IHDR", header, sizeof(header));
+
+  putChunk(out, "IDAT", idat.data(), idat.size());
+
+  putChunk(out, "IEND", nullptr, 0);
+
+  return true;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <vector>
+
+// A PNG encoder that trades file size for speed, as an alternative to stb_image_write.
+//
+// The deflate stream either stores the filtered rows as they are (level 0), or compresses them
+// with a single probe hash match finder and the fixed Huffman code (any other level), in the
+// spirit of fpng. Both are several times faster than stb's encoder.
+
+// Encodes 8 bit pixels with 1, 3 or 4 channels. A filter of -1 picks a filter per row, as stb does,
+// while 0 to 4 forces one PNG filter for every row.
+bool
+encodeFastPng(const unsigned char* pixels, int w, int h, int channels, int level, int filter, std::vector<unsigned char>& out);
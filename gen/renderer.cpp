@@ -2,38 +2,52 @@
 
 #include "scene.h"
 
+#include <algorithm>
 #include <limits>
+#include <mutex>
 
-#include <bvh/v2/executor.h>
-#include <bvh/v2/thread_pool.h>
+#include <cmath>
 
-Renderer::Renderer(const int w, const int h, const int seed)
-  : m_rngs(w * h)
+Renderer::Renderer(const int w, const int h, const int seed, bvh::v2::ThreadPool& threadPool)
+  : m_threadPool(threadPool)
+  , m_seed(static_cast<std::uint32_t>(seed))
   , m_width(w)
   , m_height(h)
+  , m_tiles(w, h)
 {
-  std::mt19937 rng(seed);
-
-  for (int i = 0; i < (w * h); i++)
-    m_rngs[i] = Rng(rng());
 }
 
-auto
-Renderer::render(const Scene& scene, const Vec3& cameraPos) -> Result
-{
-  using Ray = Scene::Ray;
+namespace {
 
-  Result result(m_width, m_height);
+// Grows the box of an instance to include a pixel (or a box), adding the box if it is the first one.
+void
+extendBox(std::vector<Renderer::ObjectBox>& boxes, const Renderer::ObjectBox& other)
+{
+  auto it = std::find_if(boxes.begin(), boxes.end(), [&other](const auto& b) { return b.instance == other.instance; });
 
-  const auto u_scale{ 1.0f / static_cast<float>(m_width) };
-  const auto v_scale{ 1.0f / static_cast<float>(m_height) };
+  if (it == boxes.end()) {
+    boxes.emplace_back(other);
+    return;
+  }
 
-  bvh::v2::ThreadPool thread_pool;
+  it->xMin = std::min(it->xMin, other.xMin);
+  it->yMin = std::min(it->yMin, other.yMin);
+  it->xMax = std::max(it->xMax, other.xMax);
+  it->yMax = std::max(it->yMax, other.yMax);
+  it->pixelCount += other.pixelCount;
+}
 
-  bvh::v2::ParallelExecutor executor(thread_pool);
+void
+sortBoxes(std::vector<Renderer::ObjectBox>& boxes)
+{
+  std::sort(boxes.begin(), boxes.end(), [](const auto& a, const auto& b) { return a.instance < b.instance; });
+}
 
-  const std::size_t pixel_count = m_width * m_height;
+} // namespace
 
+auto
+Renderer::makeCamera(const Vec3& cameraPos) const -> Camera
+{
   const Vec3 worldUp(0, 1, 0);
 
   const Vec3 cameraTarget(0, 12, 0);
@@ -43,75 +57,239 @@ Renderer::render(const Scene& scene, const Vec3& cameraPos) -> Result
 
   const float aspect = static_cast<float>(m_width) / static_cast<float>(m_height);
 
-  auto generateRay = [&](const float u, const float v) -> Ray {
-    const float dx = (u * 2.0f - 1.0f) * m_fov * aspect;
-    const float dy = (1.0f - v * 2.0f) * m_fov;
-    return Ray(cameraPos, normalize(cameraDir + cameraUp * dy + cameraRight * dx), 0, m_maxDistance);
-  };
+  return Camera{ cameraPos, cameraDir, cameraRight, cameraUp, aspect, m_fov, m_maxDistance };
+}
+
+auto
+Renderer::render(const Scene& scene, const Vec3& cameraPos, const std::uint32_t buffers) -> Result
+{
+  Result result(m_width,
+                m_height,
+                buffers,
+                std::max<std::size_t>(m_sampling.noisySpp.size(), 1) - 1,
+                m_sampling.adaptiveError > 0.0f,
+                &m_buffers);
+
+  constexpr std::uint32_t surface_buffers{ BufferAlbedo | BufferNormal | BufferDepth | BufferSegmentation |
+                                           BufferStencil | BufferBoxes | BufferInstanceId | BufferMasks };
+
+  const auto u_scale{ 1.0f / static_cast<float>(m_width) };
+  const auto v_scale{ 1.0f / static_cast<float>(m_height) };
 
-  executor.for_each(0, pixel_count, [&](const std::size_t begin, const std::size_t end) {
-    for (auto i = begin; i < end; i++) {
+  const auto camera{ makeCamera(cameraPos) };
 
-      const auto x = i % m_width;
-      const auto y = i / m_width;
+  const auto streams{ makeStreams(result, sampling::hashCombine(m_seed, m_frame++)) };
 
-      // First we get surface info from the center pixel.
-      // We get color separately, since it requires multi sampling.
+  // The object boxes are reduced per tile, then merged into the result.
+  std::mutex boxes_mutex;
 
-      {
-        const auto u = (static_cast<float>(x) + 0.5f) * u_scale;
-        const auto v = (static_cast<float>(y) + 0.5f) * v_scale;
+  auto renderPixel = [&](const int x, const int y, std::vector<ObjectBox>& boxes) {
+    const int i = y * m_width + x;
 
-        auto ray = generateRay(u, v);
+    // First we get surface info from the center pixel.
+    // We get color separately, since it requires multi sampling.
 
-        const auto surfaceInfo{ getSurfaceInfo(scene, ray) };
+    if (buffers & surface_buffers) {
+      const auto u = (static_cast<float>(x) + 0.5f) * u_scale;
+      const auto v = (static_cast<float>(y) + 0.5f) * v_scale;
 
+      auto ray = camera.generateRay(u, v);
+
+      const auto surfaceInfo{ getSurfaceInfo(scene, ray, buffers) };
+
+      if (buffers & BufferAlbedo)
         result.albedo[i] = surfaceInfo.albedo;
 
+      if (buffers & BufferDepth) {
         result.depth[i] = surfaceInfo.depth;
+        result.linear_depth[i] = surfaceInfo.distance;
+      }
 
+      if (buffers & BufferNormal)
         result.normal[i] = surfaceInfo.normal;
 
+      if (buffers & BufferSegmentation)
         result.segmentation[i] = surfaceInfo.segmentation;
 
+      if (buffers & BufferStencil)
         result.stencil[i] = surfaceInfo.objectMask ? 0xff : 0;
+
+      if (buffers & (BufferInstanceId | BufferMasks))
+        result.instance_id[i] = surfaceInfo.hit ? (surfaceInfo.instance + 1) : 0;
+
+      if ((buffers & BufferBoxes) && surfaceInfo.objectMask) {
+        const auto model = static_cast<std::uint32_t>(scene.instances()[surfaceInfo.instance].model);
+        extendBox(boxes, ObjectBox{ surfaceInfo.instance, model, x, y, x, y, 1 });
       }
+    }
 
-      // Now we get color
+    if (m_mode == Mode::Wavefront)
+      return;
 
-      std::uniform_real_distribution<float> uv_dist(0, 1);
+    // Now we get color
 
-      constexpr int low_spp{ 16 };
+    for (const auto& stream : streams)
+      accumulateSamples(scene, camera, x, y, stream);
+  };
 
-      for (int j = 0; j < low_spp; j++) {
+  m_tiles.run(m_threadPool, [&](const TileScheduler::Tile& tile) {
+    std::vector<ObjectBox> boxes;
 
-        const auto u = (static_cast<float>(x) + uv_dist(m_rngs[i])) * u_scale;
-        const auto v = (static_cast<float>(y) + uv_dist(m_rngs[i])) * v_scale;
+    for (int y = tile.yMin; y < tile.yMax; y++) {
+      for (int x = tile.xMin; x < tile.xMax; x++)
+        renderPixel(x, y, boxes);
+    }
 
-        auto ray = generateRay(u, v);
+    if (!boxes.empty()) {
+      std::lock_guard<std::mutex> lock(boxes_mutex);
+      for (const auto& box : boxes)
+        extendBox(result.boxes, box);
+    }
 
-        const auto color = trace(scene, ray, m_rngs[i], 0);
+    if (m_mode == Mode::Wavefront) {
+      for (const auto& stream : streams)
+        traceWavefront(scene, camera, tile, stream);
+    }
+  });
 
-        result.noisy_color[i] = result.noisy_color[i] + color * (1.0f / static_cast<float>(low_spp));
-      }
+  sortBoxes(result.boxes);
 
-      const int high_spp{ 256 };
+  if (buffers & BufferMasks)
+    result.masks = encodeMasks(scene, result.instance_id);
 
-      for (int j = 0; j < high_spp; j++) {
+  return result;
+}
 
-        const auto u = (static_cast<float>(x) + uv_dist(m_rngs[i])) * u_scale;
-        const auto v = (static_cast<float>(y) + uv_dist(m_rngs[i])) * v_scale;
+auto
+Renderer::encodeMasks(const Scene& scene, const Image<std::uint32_t>& instanceId) -> std::vector<ObjectMask>
+{
+  const auto& instances = scene.instances();
+
+  const auto w = instanceId.width();
+  const auto h = instanceId.height();
+
+  // Where the current run of each object started, and the runs so far, indexed by instance ID.
+
+  struct Run final
+  {
+    std::uint32_t start;
+
+    std::vector<std::uint32_t> counts;
+  };
+
+  std::vector<Run> runs(instances.size() + 1);
+
+  std::vector<bool> seen(instances.size() + 1, false);
+
+  auto isObject = [&](const std::uint32_t id) {
+    return (id > 0) && (id <= instances.size()) && instances[id - 1].objectMask;
+  };
 
-        auto ray = generateRay(u, v);
+  std::uint32_t previous{ 0 };
 
-        const auto color = trace(scene, ray, m_rngs[i], 0);
+  std::uint32_t k{ 0 };
 
-        result.color[i] = result.color[i] + color * (1.0f / static_cast<float>(high_spp));
+  for (int x = 0; x < w; x++) {
+    for (int y = 0; y < h; y++, k++) {
+
+      const auto id = instanceId[y * w + x];
+
+      if (id == previous)
+        continue;
+
+      // Ends the run inside the previous object, and the run outside of the new one.
+
+      if (isObject(previous)) {
+        runs[previous].counts.emplace_back(k - runs[previous].start);
+        runs[previous].start = k;
+      }
+
+      if (isObject(id)) {
+        runs[id].counts.emplace_back(k - runs[id].start);
+        runs[id].start = k;
+        seen[id] = true;
       }
+
+      previous = id;
     }
-  });
+  }
 
-  return result;
+  std::vector<ObjectMask> masks;
+
+  for (std::uint32_t id = 1; id < runs.size(); id++) {
+
+    if (!seen[id])
+      continue;
+
+    auto& run = runs[id];
+
+    if (run.start < k)
+      run.counts.emplace_back(k - run.start);
+
+    masks.emplace_back(
+      ObjectMask{ id - 1, static_cast<std::uint32_t>(instances[id - 1].model), std::move(run.counts) });
+  }
+
+  return masks;
+}
+
+auto
+Renderer::projectBoxes(const Scene& scene, const Vec3& cameraPos) const -> std::vector<ObjectBox>
+{
+  const auto camera{ makeCamera(cameraPos) };
+
+  std::vector<ObjectBox> boxes;
+
+  const auto& instances = scene.instances();
+
+  for (std::size_t i = 0; i < instances.size(); i++) {
+
+    const auto& instance = instances[i];
+
+    if (!instance.objectMask)
+      continue;
+
+    float u_min{ std::numeric_limits<float>::max() };
+    float v_min{ std::numeric_limits<float>::max() };
+    float u_max{ std::numeric_limits<float>::lowest() };
+    float v_max{ std::numeric_limits<float>::lowest() };
+
+    auto add = [&](const Vec3& p) {
+      const auto q = instance.transform * glm::vec4(p[0], p[1], p[2], 1.0f);
+      if (const auto uv = camera.project(Vec3(q.x, q.y, q.z))) {
+        u_min = std::min(u_min, (*uv)[0]);
+        v_min = std::min(v_min, (*uv)[1]);
+        u_max = std::max(u_max, (*uv)[0]);
+        v_max = std::max(v_max, (*uv)[1]);
+      }
+    };
+
+    for (const auto& position : scene.model(instance.model).positions)
+      add(position);
+
+    // No vertex is in front of the camera.
+    if ((u_min > u_max) || (v_min > v_max))
+      continue;
+
+    // Pixel x covers [x, x + 1) in image units, so the box holds the pixels the projected bounds overlap. Vertices
+    // just in front of the camera project far outside the image, so the bounds are clamped before they become ints.
+
+    const auto width = static_cast<float>(m_width);
+    const auto height = static_cast<float>(m_height);
+
+    const auto x_min = static_cast<int>(std::floor(std::clamp(u_min * width, 0.0f, width)));
+    const auto y_min = static_cast<int>(std::floor(std::clamp(v_min * height, 0.0f, height)));
+    const auto x_max = static_cast<int>(std::ceil(std::clamp(u_max * width, 0.0f, width))) - 1;
+    const auto y_max = static_cast<int>(std::ceil(std::clamp(v_max * height, 0.0f, height))) - 1;
+
+    if ((x_min > x_max) || (y_min > y_max))
+      continue;
+
+    boxes.emplace_back(ObjectBox{
+      static_cast<std::uint32_t>(i), static_cast<std::uint32_t>(instance.model), x_min, y_min, x_max, y_max, 0 });
+  }
+
+  return boxes;
 }
 
 namespace {
@@ -146,24 +324,34 @@ depthToColor(const float depth, const float minDepth, const float maxDepth)
 } // namespace
 
 auto
-Renderer::getSurfaceInfo(const Scene& scene, Ray& ray) -> SurfaceInfo
+Renderer::getSurfaceInfo(const Scene& scene, Ray& ray, const std::uint32_t buffers) -> SurfaceInfo
 {
-  auto hit{ scene.intersect(ray) };
+  const auto closest{ scene.intersectClosest(ray) };
+
+  if (!closest)
+    return SurfaceInfo{ onMiss(ray), Vec3(0, 0, 0), -ray.dir, Vec3(0, 0, 0), false, 0.0f, 0, false };
 
-  if (!hit)
-    return SurfaceInfo{ onMiss(ray), Vec3(0, 0, 0), -ray.dir, Vec3(0, 0, 0) };
+  const auto& instance = scene.instances()[closest->instance];
 
-  const auto albedo = hit->albedo;
+  SurfaceInfo info{ instance.albedo,
+                    depthToColor(ray.tmax, m_minDistance, m_maxDistance),
+                    Vec3(0, 0, 0),
+                    Vec3(0, 0, 0),
+                    instance.objectMask,
+                    ray.tmax,
+                    closest->instance,
+                    true };
 
-  const auto emission = hit->emission;
+  // Depth, stencil and instance ids need nothing but the intersection. Of the rest, only the normal costs more
+  // than a lookup.
 
-  const auto normal = hit->normal;
+  if (buffers & BufferNormal)
+    info.normal = (scene.normal(*closest, ray.dir) + Vec3(1.0f)) * 0.5f;
 
-  return { albedo,
-           depthToColor(ray.tmax, m_minDistance, m_maxDistance),
-           (normal + Vec3(1.0f)) * 0.5f,
-           hit->segmentation,
-           hit->objectMask };
+  if (buffers & BufferSegmentation)
+    info.segmentation = scene.model(instance.model).segmentation;
+
+  return info;
 }
 
 void
@@ -174,33 +362,474 @@ Renderer::setSkyColors(const Vec3& lo, const Vec3& hi)
 }
 
 auto
-Renderer::trace(const Scene& scene, Ray& ray, Rng& rng, int depth) -> Vec3
+Renderer::makeStreams(Result& result, const std::uint32_t frameSeed) const -> std::vector<SampleStream>
 {
-  if (depth > m_maxDepth)
-    return Vec3(0, 0, 0);
+  // Images that are not requested get no samples, so their streams are dropped below.
+
+  std::vector<Snapshot> noisy;
+
+  if (result.buffers & BufferNoisy) {
+    for (std::size_t i = 0; i < m_sampling.noisySpp.size(); i++) {
+      auto* image = (i == 0) ? &result.noisy_color : &result.noisy_levels[i - 1];
+      noisy.emplace_back(Snapshot{ m_sampling.noisySpp[i], image });
+    }
+  }
+
+  const Snapshot reference{ (result.buffers & BufferColor) ? m_sampling.referenceSpp : 0, &result.color };
+
+  std::vector<SampleStream> streams;
+
+  if (m_sampling.shared) {
+    noisy.emplace_back(reference);
+    streams.emplace_back(SampleStream{ noisy });
+  } else {
+    streams.emplace_back(SampleStream{ noisy });
+    streams.emplace_back(SampleStream{ { reference } });
+  }
+
+  for (std::size_t i = 0; i < streams.size(); i++)
+    streams[i].seed = sampling::hashCombine(frameSeed, static_cast<std::uint32_t>(i));
+
+  for (auto& stream : streams) {
+    std::erase_if(stream.snapshots, [](const auto& snapshot) { return snapshot.spp <= 0; });
+    std::stable_sort(stream.snapshots.begin(), stream.snapshots.end(), [](const auto& a, const auto& b) {
+      return a.spp < b.spp;
+    });
+  }
+
+  std::erase_if(streams, [](const auto& stream) { return stream.snapshots.empty(); });
+
+  // Only the stream that ends with the reference image stops early, and only
+  // once every noisy snapshot along the way has been taken.
+
+  if ((m_sampling.adaptiveError > 0.0f) && !streams.empty() && (streams.back().snapshots.back().image == &result.color)) {
+    auto& stream = streams.back();
+    stream.sampleCount = &result.sample_count;
+    stream.minSpp = m_sampling.adaptiveMinSpp;
+    for (std::size_t i = 0; (i + 1) < stream.snapshots.size(); i++)
+      stream.minSpp = std::max(stream.minSpp, stream.snapshots[i].spp);
+  }
+
+  return streams;
+}
+
+namespace {
+
+float
+luminance(const Vec3& c)
+{
+  return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+// Running mean and variance of a pixel's sample luminance (Welford's algorithm).
+struct PixelStats final
+{
+  int count{ 0 };
+
+  float mean{ 0 };
+
+  float m2{ 0 };
+
+  void add(const float x)
+  {
+    count++;
+    const auto delta = x - mean;
+    mean += delta / static_cast<float>(count);
+    m2 += delta * (x - mean);
+  }
+
+  // The standard error of the mean, relative to the mean.
+  float relativeError() const
+  {
+    if (count < 2)
+      return std::numeric_limits<float>::infinity();
+
+    const auto variance_of_mean = m2 / static_cast<float>((count - 1) * count);
+
+    return std::sqrt(variance_of_mean) / std::max(mean, 1.0e-3f);
+  }
+};
+
+} // namespace
+
+bool
+Renderer::isConverged(const SampleStream& stream, const int spp, const float relativeError) const
+{
+  if (spp >= stream.spp())
+    return true;
+
+  if ((stream.sampleCount == nullptr) || (spp < stream.minSpp))
+    return false;
+
+  return relativeError < m_sampling.adaptiveError;
+}
+
+void
+Renderer::accumulateSamples(const Scene& scene, const Camera& camera, const int x, const int y, const SampleStream& stream)
+{
+  const auto u_scale{ 1.0f / static_cast<float>(m_width) };
+  const auto v_scale{ 1.0f / static_cast<float>(m_height) };
+
+  const int i = y * m_width + x;
+
+  const auto seed = sampling::hashCombine(stream.seed, static_cast<std::uint32_t>(i));
+
+  const int spp = stream.spp();
+
+  Vec3 sum(0, 0, 0);
+
+  PixelStats stats;
+
+  auto snapshot = stream.snapshots.begin();
+
+  while (!isConverged(stream, stats.count, stats.relativeError())) {
+
+    const auto j = stats.count;
+
+    const auto lanes = std::min(Scene::packetSize, spp - j);
+
+    Scene::RayPacket packet;
+
+    Sampler samplers[Scene::packetSize];
+
+    for (int k = 0; k < Scene::packetSize; k++) {
+
+      if (k >= lanes) {
+        packet.disable(k);
+        continue;
+      }
+
+      samplers[k] = Sampler(seed, static_cast<std::uint32_t>(j + k));
+
+      const auto jitter = samplers[k].next2D();
+
+      const auto u = (static_cast<float>(x) + jitter[0]) * u_scale;
+      const auto v = (static_cast<float>(y) + jitter[1]) * v_scale;
+
+      packet.setRay(k, camera.generateRay(u, v));
+    }
+
+    Scene::PacketHits hits;
+
+    scene.intersect(packet, hits);
+
+    for (int k = 0; k < lanes; k++) {
 
-  auto hit{ scene.intersect(ray) };
+      const auto color = trace(scene, packet.getRay(k), hits[k], samplers[k]);
 
-  if (!hit)
-    return onMiss(ray);
+      sum = sum + color;
 
-  const auto albedo = hit->albedo;
+      stats.add(luminance(color));
 
-  const auto emission = hit->emission;
+      for (; (snapshot != stream.snapshots.end()) && (snapshot->spp == stats.count); ++snapshot)
+        (*snapshot->image)[i] = sum * (1.0f / static_cast<float>(stats.count));
+    }
+  }
 
-  const auto normal = hit->normal;
+  // Snapshots beyond the point where the pixel converged get the average of the samples taken.
 
-  const auto next_dir = sampleHemisphere(rng, normal);
+  for (; snapshot != stream.snapshots.end(); ++snapshot)
+    (*snapshot->image)[i] = sum * (1.0f / static_cast<float>(stats.count));
 
-  const auto next_org = ray.org + (ray.dir * (ray.tmax - 0.001f));
+  if (stream.sampleCount)
+    (*stream.sampleCount)[i] = Vec3(static_cast<float>(stats.count) / static_cast<float>(spp));
+}
+
+namespace {
 
-  auto second_ray{ Ray(next_org, next_dir, 0.0f, std::numeric_limits<float>::infinity()) };
+// Buckets a direction into one of 64 cells, so that rays heading the same way end up in the same packets.
+int
+directionBin(const Vec3& dir)
+{
+  auto quantize = [](const float c) { return std::clamp(static_cast<int>((c + 1.0f) * 2.0f), 0, 3); };
 
-  return albedo * trace(scene, second_ray, rng, depth + 1) + emission;
+  return quantize(dir[0]) | (quantize(dir[1]) << 2) | (quantize(dir[2]) << 4);
 }
 
+} // namespace
+
+void
+Renderer::traceWavefront(const Scene& scene,
+                         const Camera& camera,
+                         const TileScheduler::Tile& tile,
+                         const SampleStream& stream)
+{
+  const auto u_scale{ 1.0f / static_cast<float>(m_width) };
+  const auto v_scale{ 1.0f / static_cast<float>(m_height) };
+
+  const int tile_w = tile.xMax - tile.xMin;
+
+  const int tile_pixels = tile_w * (tile.yMax - tile.yMin);
+
+  const int spp = stream.spp();
+
+  const int wave_spp = std::clamp(m_wavefrontSize / std::max(tile_pixels, 1), 1, spp);
+
+  // Each sample adds to the sum of the first snapshot that includes it, and the
+  // snapshots are resolved from the running total of these sums at the end.
+
+  const auto snapshot_count = static_cast<int>(stream.snapshots.size());
+
+  std::vector<Vec3> sums(static_cast<std::size_t>(tile_pixels * snapshot_count), Vec3(0, 0, 0));
+
+  std::vector<PixelStats> stats(static_cast<std::size_t>(tile_pixels));
+
+  std::vector<PathState> paths;
+
+  std::vector<PathState> sorted;
+
+  std::vector<PathState> next;
+
+  constexpr int bin_count{ 64 };
+
+  auto finish = [&](const PathState& path) {
+    sums[path.slot] = sums[path.slot] + path.radiance;
+    stats[path.slot / snapshot_count].add(luminance(path.radiance));
+  };
+
+  while (true) {
+
+    // Start the next wave of samples for the pixels that have not converged yet.
+
+    paths.clear();
+
+    for (int y = tile.yMin; y < tile.yMax; y++) {
+      for (int x = tile.xMin; x < tile.xMax; x++) {
+        const int i = y * m_width + x;
+        const int tile_pixel = (y - tile.yMin) * tile_w + (x - tile.xMin);
+        const auto& pixel_stats = stats[tile_pixel];
+        if (isConverged(stream, pixel_stats.count, pixel_stats.relativeError()))
+          continue;
+        auto snapshot = 0;
+        for (int j = pixel_stats.count; j < std::min(pixel_stats.count + wave_spp, spp); j++) {
+          while (stream.snapshots[snapshot].spp <= j)
+            snapshot++;
+          const auto seed = sampling::hashCombine(stream.seed, static_cast<std::uint32_t>(i));
+          Sampler sampler(seed, static_cast<std::uint32_t>(j));
+          const auto jitter = sampler.next2D();
+          const auto u = (static_cast<float>(x) + jitter[0]) * u_scale;
+          const auto v = (static_cast<float>(y) + jitter[1]) * v_scale;
+          const auto slot = tile_pixel * snapshot_count + snapshot;
+          paths.emplace_back(
+            PathState{ camera.generateRay(u, v), Vec3(1.0f), Vec3(0.0f), 0.0f, i, slot, 0, sampler });
+        }
+      }
+    }
+
+    if (paths.empty())
+      break;
+
+    while (!paths.empty()) {
+
+      // Counting sort of the active paths by direction.
+
+      int offsets[bin_count + 1]{};
+
+      for (const auto& path : paths)
+        offsets[directionBin(path.ray.dir) + 1]++;
+
+      for (int i = 0; i < bin_count; i++)
+        offsets[i + 1] += offsets[i];
+
+      sorted.resize(paths.size());
+
+      for (const auto& path : paths)
+        sorted[offsets[directionBin(path.ray.dir)]++] = path;
+
+      next.clear();
+
+      for (std::size_t j = 0; j < sorted.size(); j += Scene::packetSize) {
+
+        const auto lanes = static_cast<int>(std::min<std::size_t>(Scene::packetSize, sorted.size() - j));
+
+        Scene::RayPacket packet;
+
+        for (int k = 0; k < Scene::packetSize; k++) {
+          if (k < lanes)
+            packet.setRay(k, sorted[j + k].ray);
+          else
+            packet.disable(k);
+        }
+
+        Scene::PacketHits hits;
+
+        scene.intersect(packet, hits);
+
+        for (int k = 0; k < lanes; k++) {
+
+          auto path = sorted[j + k];
+
+          path.ray = packet.getRay(k);
+
+          if (scatter(scene, path, hits[k]))
+            next.emplace_back(path);
+          else
+            finish(path);
+        }
+      }
+
+      std::swap(paths, next);
+    }
+  }
+
+  for (int y = tile.yMin; y < tile.yMax; y++) {
+    for (int x = tile.xMin; x < tile.xMax; x++) {
+      const int i = y * m_width + x;
+      const int tile_pixel = (y - tile.yMin) * tile_w + (x - tile.xMin);
+      const auto taken = stats[tile_pixel].count;
+      Vec3 sum(0, 0, 0);
+      for (int j = 0; j < snapshot_count; j++) {
+        const auto& snapshot = stream.snapshots[j];
+        sum = sum + sums[tile_pixel * snapshot_count + j];
+        (*snapshot.image)[i] = sum * (1.0f / static_cast<float>(std::min(snapshot.spp, taken)));
+      }
+      if (stream.sampleCount)
+        (*stream.sampleCount)[i] = Vec3(static_cast<float>(taken) / static_cast<float>(spp));
+    }
+  }
+}
+
+namespace {
+
+constexpr float pi{ 3.14159265358979f };
+
+// The power heuristic weight of a sample drawn with density 'a', when 'b' is the density of the other strategy.
+float
+powerHeuristic(const float a, const float b)
+{
+  return (a * a) / (a * a + b * b);
+}
+
+} // namespace
+
 auto
-Renderer::onMiss(const Ray& ray) -> Vec3
+Renderer::trace(const Scene& scene,
+                const Ray& ray,
+                const std::optional<Scene::Hit>& hit,
+                const Sampler& sampler) const -> Vec3
+{
+  PathState path{ ray, Vec3(1.0f), Vec3(0.0f), 0.0f, 0, 0, 0, sampler };
+
+  auto next_hit{ hit };
+
+  while (scatter(scene, path, next_hit))
+    next_hit = scene.intersect(path.ray);
+
+  return path.radiance;
+}
+
+bool
+Renderer::scatter(const Scene& scene, PathState& path, const std::optional<Scene::Hit>& hit) const
+{
+  const auto& ray = path.ray;
+
+  const auto is_camera_ray = path.pdf <= 0.0f;
+
+  if (!hit) {
+    const auto weight = is_camera_ray ? 1.0f : powerHeuristic(path.pdf, skyPdf(ray.dir));
+    path.radiance = path.radiance + path.throughput * onMiss(ray) * weight;
+    return false;
+  }
+
+  if (luminance(hit->emission) > 0.0f) {
+    auto weight{ 1.0f };
+    if (!is_camera_ray)
+      weight = powerHeuristic(path.pdf, scene.lightPdf(hit->emission, hit->faceNormal, ray.dir, ray.tmax));
+    path.radiance = path.radiance + path.throughput * hit->emission * weight;
+  }
+
+  if ((path.depth + 1) > m_maxDepth)
+    return false;
+
+  auto& sampler = path.sampler;
+
+  const auto& n = hit->normal;
+
+  const auto position = ray.org + (ray.dir * (ray.tmax - 0.001f));
+
+  const auto brdf = hit->albedo * (1.0f / pi);
+
+  // Light arriving straight from the sky, sampled where the sky is bright.
+
+  {
+    const auto dir = sampleSky(sampler.next2D());
+
+    const auto pdf = skyPdf(dir);
+
+    const Ray shadow_ray(position, dir, 0.0f, std::numeric_limits<float>::infinity());
+
+    if ((pdf > 0.0f) && (dot(n, dir) > 0.0f) && !scene.occluded(shadow_ray)) {
+      const auto weight = powerHeuristic(pdf, bsdfPdf(n, dir));
+      path.radiance = path.radiance + path.throughput * brdf * onMiss(shadow_ray) * (dot(n, dir) * weight / pdf);
+    }
+  }
+
+  // Light arriving straight from an emissive surface.
+
+  if (scene.hasLights()) {
+
+    const auto u = sampler.next2D();
+
+    const auto light = scene.sampleLight(sampler.next1D(), u[0], u[1]);
+
+    const auto to_light = light.position - position;
+
+    const auto distance_sq = dot(to_light, to_light);
+
+    const auto distance = std::sqrt(distance_sq);
+
+    const auto dir = to_light * (1.0f / distance);
+
+    const auto cos_surface = dot(n, dir);
+
+    const auto pdf = scene.lightPdf(light.emission, light.normal, dir, distance);
+
+    if ((cos_surface > 0.0f) && (pdf > 0.0f)) {
+
+      const Ray shadow_ray(position, dir, 0.0f, distance * 0.999f);
+
+      if (!scene.occluded(shadow_ray)) {
+        const auto weight = powerHeuristic(pdf, bsdfPdf(n, dir));
+        path.radiance = path.radiance + path.throughput * brdf * light.emission * (cos_surface * weight / pdf);
+      }
+    }
+  }
+
+  // Continue the path in a direction picked by the BSDF.
+
+  const auto dir = sampleHemisphere(sampler.next2D(), n);
+
+  const auto pdf = bsdfPdf(n, dir);
+
+  if (pdf <= 0.0f)
+    return false;
+
+  // The cosine in the density cancels the one in the estimator.
+  path.throughput = path.throughput * hit->albedo;
+
+  if (path.depth >= m_rouletteDepth) {
+
+    const auto& t = path.throughput;
+
+    const auto survival = std::min(std::max(std::max(t[0], t[1]), t[2]), 0.95f);
+
+    if (sampler.next1D() >= survival)
+      return false;
+
+    path.throughput = path.throughput * (1.0f / survival);
+  }
+
+  path.ray = Ray(position, dir, 0.0f, std::numeric_limits<float>::infinity());
+
+  path.pdf = pdf;
+
+  path.depth++;
+
+  return true;
+}
+
+auto
+Renderer::onMiss(const Ray& ray) const -> Vec3
 {
   const auto up = Vec3(0, 1, 0);
   const auto level = (dot(ray.dir, up) + 1.0f) * 0.5f;
@@ -208,17 +837,78 @@ Renderer::onMiss(const Ray& ray) -> Vec3
 }
 
 auto
-Renderer::sampleHemisphere(Rng& rng, const Vec3& n) -> Vec3
+Renderer::sampleHemisphere(const std::array<float, 2>& u, const Vec3& n) -> Vec3
 {
-  std::uniform_real_distribution<float> dist(-1, 1);
+  // A point on the unit disk, projected up onto the hemisphere around +z.
 
-  while (true) {
-    const auto v{ Vec3(dist(rng), dist(rng), dist(rng)) };
-    if (dot(v, v) <= 1.0f) {
-      if (dot(v, n) < 0)
-        return normalize(v * ((dot(v, n) < 0) ? -1.0f : 1.0f));
-    }
-  }
+  const auto r = std::sqrt(u[0]);
+  const auto phi = 2.0f * pi * u[1];
+  const auto x = r * std::cos(phi);
+  const auto y = r * std::sin(phi);
+  const auto z = std::sqrt(std::max(1.0f - u[0], 0.0f));
+
+  // A branchless orthonormal basis around the normal (Duff et al., 2017).
+
+  const auto sign = std::copysign(1.0f, n[2]);
+  const auto a = -1.0f / (sign + n[2]);
+  const auto b = n[0] * n[1] * a;
+  const auto t = Vec3(1.0f + sign * n[0] * n[0] * a, sign * b, -sign * n[0]);
+  const auto s = Vec3(b, sign + n[1] * n[1] * a, -n[1]);
+
+  return t * x + s * y + n * z;
+}
+
+float
+Renderer::bsdfPdf(const Vec3& n, const Vec3& dir)
+{
+  return std::max(dot(n, dir), 0.0f) / pi;
+}
+
+// The sky's luminance is a + b * y over the sphere, from the luminances of its low and high colors.
+void
+Renderer::skyLuminance(float& a, float& b) const
+{
+  const auto lo = luminance(m_skyLow);
+  const auto hi = luminance(m_skyHigh);
+
+  a = std::max((lo + hi) * 0.5f, 0.0f);
+  b = (hi - lo) * 0.5f;
+}
+
+auto
+Renderer::sampleSky(const std::array<float, 2>& u) const -> Vec3
+{
+  float a{ 0 };
+  float b{ 0 };
+
+  skyLuminance(a, b);
+
+  // The height is drawn from the density (a + b * y) / 2a on [-1, 1], by solving for the root of its cumulative
+  // distribution in the form that stays accurate as b goes to zero. The azimuth is uniform.
+
+  const auto c0 = a - 0.5f * b - 2.0f * a * u[0];
+
+  const auto root = std::sqrt(std::max(a * a - 2.0f * b * c0, 0.0f));
+
+  const auto y = ((a + root) > 0.0f) ? std::clamp(-2.0f * c0 / (a + root), -1.0f, 1.0f) : (2.0f * u[0] - 1.0f);
+
+  const auto r = std::sqrt(std::max(1.0f - y * y, 0.0f));
+
+  const auto phi = 2.0f * pi * u[1];
+
+  return Vec3(r * std::cos(phi), y, r * std::sin(phi));
+}
+
+float
+Renderer::skyPdf(const Vec3& dir) const
+{
+  float a{ 0 };
+  float b{ 0 };
+
+  skyLuminance(a, b);
+
+  if (a <= 0.0f)
+    return 0.0f;
 
-  return Vec3(0, 1, 0);
+  return std::max(a + b * dir[1], 0.0f) / (4.0f * pi * a);
 }
@@ -1,22 +1,23 @@
 #pragma once
 
 #include "image.h"
+#include "sampler.h"
+#include "scene.h"
+#include "tile_scheduler.h"
 
 #include <bvh/v2/ray.h>
+#include <bvh/v2/thread_pool.h>
 #include <bvh/v2/vec.h>
 
 #include <glm/glm.hpp>
 
-#include <random>
+#include <array>
+#include <optional>
+#include <vector>
 
 #include <cmath>
 #include <cstdint>
 
-template<typename T>
-class Image;
-
-class Scene;
-
 class Renderer final
 {
 public:
@@ -24,8 +25,63 @@ public:
 
   using Ray = bvh::v2::Ray<float, 3>;
 
+  // The images of a result, as bits of a mask. Images that are not requested are neither computed nor allocated.
+  enum Buffer : std::uint32_t
+  {
+    // Result::noisy_color and Result::noisy_levels.
+    BufferNoisy = 1 << 0,
+    // Result::color and, when sampling adaptively, Result::sample_count.
+    BufferColor = 1 << 1,
+    BufferAlbedo = 1 << 2,
+    BufferNormal = 1 << 3,
+    // Result::depth and Result::linear_depth.
+    BufferDepth = 1 << 4,
+    BufferSegmentation = 1 << 5,
+    BufferStencil = 1 << 6,
+    // Result::boxes.
+    BufferBoxes = 1 << 7,
+    BufferInstanceId = 1 << 8,
+    // Result::masks, which also renders Result::instance_id.
+    BufferMasks = 1 << 9,
+    BufferAll = (1 << 10) - 1
+  };
+
+  // The pixels covered by an object instance (one flagged with an object mask), with inclusive bounds.
+  struct ObjectBox final
+  {
+    std::uint32_t instance;
+
+    // The index of the instance's model, which serves as the object's class.
+    std::uint32_t classId;
+
+    int xMin;
+
+    int yMin;
+
+    int xMax;
+
+    int yMax;
+
+    // The number of pixels the object is visible in, or zero for a projected box.
+    std::uint32_t pixelCount;
+  };
+
+  // The pixels of an object instance as COCO style run lengths: the pixels are taken in column major order,
+  // and the runs alternate between pixels outside and inside of the object, starting with those outside.
+  struct ObjectMask final
+  {
+    std::uint32_t instance;
+
+    std::uint32_t classId;
+
+    std::vector<std::uint32_t> counts;
+  };
+
   struct Result final
   {
+    // The buffers that hold an image. The others are empty (0 by 0) images.
+    std::uint32_t buffers;
+
     Image<Vec3> albedo;
 
     Image<Vec3> noisy_color;
@@ -40,21 +96,116 @@ public:
 
     Image<unsigned char> stencil;
 
-    Result(int w, int h)
-      : albedo(w, h)
-      , noisy_color(w, h)
-      , color(w, h)
-      , normal(w, h)
-      , depth(w, h)
-      , segmentation(w, h)
-      , stencil(w, h)
+    // One plus the index of the instance seen through the center of each pixel, zero where nothing is hit.
+    Image<std::uint32_t> instance_id;
+
+    // The distance from the camera to the first hit along the center ray of each pixel, zero where nothing is hit.
+    // Unlike 'depth', this is neither clamped to the depth range nor mapped to colors.
+    Image<float> linear_depth;
+
+    // One image per additional noise level (see Sampling::noisySpp).
+    std::vector<Image<Vec3>> noisy_levels;
+
+    // The fraction of the reference samples that each pixel took, when sampling adaptively.
+    Image<Vec3> sample_count;
+
+    // The visible objects, sorted by instance.
+    std::vector<ObjectBox> boxes;
+
+    // The masks of the visible objects, sorted by instance.
+    std::vector<ObjectMask> masks;
+
+    // The images are taken from the pool when one is given, and go back to it when the result is destroyed.
+    Result(int w,
+           int h,
+           std::uint32_t buffers = BufferAll,
+           std::size_t extraNoisyLevels = 0,
+           bool withSampleCount = false,
+           BufferPool* pool = nullptr)
+      : buffers(buffers)
+      , albedo(sized(w, buffers, BufferAlbedo), sized(h, buffers, BufferAlbedo), pool)
+      , noisy_color(sized(w, buffers, BufferNoisy), sized(h, buffers, BufferNoisy), pool)
+      , color(sized(w, buffers, BufferColor), sized(h, buffers, BufferColor), pool)
+      , normal(sized(w, buffers, BufferNormal), sized(h, buffers, BufferNormal), pool)
+      , depth(sized(w, buffers, BufferDepth), sized(h, buffers, BufferDepth), pool)
+      , segmentation(sized(w, buffers, BufferSegmentation), sized(h, buffers, BufferSegmentation), pool)
+      , stencil(sized(w, buffers, BufferStencil), sized(h, buffers, BufferStencil), pool)
+      , instance_id(sized(w, buffers, BufferInstanceId | BufferMasks),
+                    sized(h, buffers, BufferInstanceId | BufferMasks),
+                    pool)
+      , linear_depth(sized(w, buffers, BufferDepth), sized(h, buffers, BufferDepth), pool)
+      , sample_count(withSampleCount ? sized(w, buffers, BufferColor) : 0,
+                     withSampleCount ? sized(h, buffers, BufferColor) : 0,
+                     pool)
+    {
+      if (buffers & BufferNoisy) {
+        for (std::size_t i = 0; i < extraNoisyLevels; i++)
+          noisy_levels.emplace_back(w, h, pool);
+      }
+    }
+
+  private:
+    static int sized(const int extent, const std::uint32_t buffers, const std::uint32_t buffer)
     {
+      return (buffers & buffer) ? extent : 0;
     }
   };
 
-  explicit Renderer(int w, int h, int seed);
+  struct Sampling final
+  {
+    // The samples per pixel of each noisy image.
+    // The first level is written to Result::noisy_color and the rest to Result::noisy_levels.
+    std::vector<int> noisySpp{ 16 };
+
+    // The samples per pixel of the reference color image.
+    int referenceSpp{ 256 };
+
+    // When set, the noisy images are snapshots of the first samples of the reference image,
+    // instead of being traced separately. This saves work, but correlates the noise with the reference.
+    bool shared{ false };
+
+    // When above zero, a pixel of the reference image stops sampling once the standard error of its mean
+    // luminance, relative to the mean, falls below this value. The reference sample count becomes a cap.
+    float adaptiveError{ 0.0f };
+
+    // The fewest samples a pixel takes before adaptive sampling may stop it.
+    int adaptiveMinSpp{ 32 };
+  };
+
+  enum class Mode
+  {
+    // Each sample follows its whole path before the next one starts.
+    DepthFirst,
+    // The samples of a tile advance one bounce at a time, sorted by direction and intersected in packets.
+    Wavefront
+  };
 
-  Result render(const Scene& scene, const Vec3& cameraPos);
+  Renderer(int w, int h, int seed, bvh::v2::ThreadPool& threadPool);
+
+  void setMode(const Mode mode) { m_mode = mode; }
+
+  void setSampling(const Sampling& sampling) { m_sampling = sampling; }
+
+  // The most bounces a path takes before it is terminated.
+  void setMaxDepth(const int maxDepth) { m_maxDepth = maxDepth; }
+
+  // Restarts the sequence of frames from a new seed, so that the frames of a job only depend on the job's seed.
+  void setSeed(const int seed)
+  {
+    m_seed = static_cast<std::uint32_t>(seed);
+    m_frame = 0;
+  }
+
+  const Sampling& sampling() const { return m_sampling; }
+
+  // Renders the buffers in the mask. The path traced images are the expensive ones, and leaving out
+  // BufferNoisy and BufferColor leaves a single ray per pixel.
+  Result render(const Scene& scene, const Vec3& cameraPos, std::uint32_t buffers = BufferAll);
+
+  // The boxes of the objects found by projecting the vertices of their models onto the image, without tracing
+  // any rays. Occlusion is ignored, so a box covers the whole object even where it is hidden, and vertices
+  // behind the camera are left out.
+  std::vector<ObjectBox> projectBoxes(const Scene& scene, const Vec3& cameraPos) const;
 
   void setSkyColors(const std::uint32_t lo, const std::uint32_t hi)
   {
@@ -68,7 +219,48 @@ public:
   void setSkyColors(const Vec3& lo, const Vec3& hi);
 
 protected:
-  using Rng = std::minstd_rand;
+  using Sampler = sampling::Sampler;
+
+  struct Camera final
+  {
+    Vec3 position;
+
+    Vec3 dir;
+
+    Vec3 right;
+
+    Vec3 up;
+
+    float aspect;
+
+    float fov;
+
+    float maxDistance;
+
+    Ray generateRay(const float u, const float v) const
+    {
+      const float dx = (u * 2.0f - 1.0f) * fov * aspect;
+      const float dy = (1.0f - v * 2.0f) * fov;
+      return Ray(position, normalize(dir + up * dy + right * dx), 0, maxDistance);
+    }
+
+    // The inverse of generateRay, giving the (u, v) coordinates of a point in front of the camera.
+    std::optional<std::array<float, 2>> project(const Vec3& point) const
+    {
+      const auto d = point - position;
+      const auto z = dot(d, dir);
+      if (z <= 0.0f)
+        return std::nullopt;
+      const auto dx = dot(d, right) / (dot(right, right) * z);
+      const auto dy = dot(d, up) / (dot(up, up) * z);
+      return std::array<float, 2>{ (dx / (fov * aspect) + 1.0f) * 0.5f, (1.0f - dy / fov) * 0.5f };
+    }
+  };
+
+  Camera makeCamera(const Vec3& cameraPos) const;
+
+  // Run length encodes the object instances found in an instance ID image.
+  static std::vector<ObjectMask> encodeMasks(const Scene& scene, const Image<std::uint32_t>& instanceId);
 
   struct SurfaceInfo final
   {
@@ -81,24 +273,132 @@ protected:
     Vec3 segmentation;
 
     bool objectMask;
+
+    // The distance along the camera ray, or zero if nothing was hit.
+    float distance;
+
+    std::uint32_t instance;
+
+    bool hit;
   };
 
-  SurfaceInfo getSurfaceInfo(const Scene& scene, Ray& ray);
+  // Looks up only the attributes that the requested buffers need.
+  SurfaceInfo getSurfaceInfo(const Scene& scene, Ray& ray, std::uint32_t buffers);
+
+  // The average of the first 'spp' samples of a stream is written to the image.
+  struct Snapshot final
+  {
+    int spp;
 
-  Vec3 trace(const Scene& scene, Ray& ray, Rng& rng, int depth);
+    Image<Vec3>* image;
+  };
+
+  // A sequence of samples per pixel, from which one or more images are taken.
+  struct SampleStream final
+  {
+    // Sorted by sample count. The last snapshot covers the whole stream.
+    std::vector<Snapshot> snapshots;
+
+    // Where the sample count of each pixel is written, if the stream samples adaptively.
+    Image<Vec3>* sampleCount{ nullptr };
+
+    int minSpp{ 0 };
+
+    // Scrambles the sample sequences of the stream. Pixels derive their own seed from it.
+    std::uint32_t seed{ 0 };
+
+    int spp() const { return snapshots.back().spp; }
+  };
+
+  std::vector<SampleStream> makeStreams(Result& result, std::uint32_t frameSeed) const;
+
+  // Whether a pixel that has taken 'spp' samples of the stream is done.
+  bool isConverged(const SampleStream& stream, int spp, float relativeError) const;
+
+  struct PathState final
+  {
+    // The latest ray of the path. Once intersected, tmax is the distance to the hit.
+    Ray ray;
 
-  Vec3 onMiss(const Ray& ray);
+    Vec3 throughput;
 
-  static Vec3 sampleHemisphere(Rng& rng, const Vec3& n);
+    Vec3 radiance;
+
+    // The density with which the ray's direction was sampled. Zero means the ray came from the camera.
+    float pdf;
+
+    int pixel;
+
+    // Where the path's radiance is accumulated, in the per-tile snapshot sums.
+    int slot;
+
+    int depth;
+
+    // Continues the low discrepancy sequence of the path's sample, one dimension pair per decision.
+    Sampler sampler;
+  };
+
+  // Traces the samples of every pixel in a tile breadth first.
+  void traceWavefront(const Scene& scene,
+                      const Camera& camera,
+                      const TileScheduler::Tile& tile,
+                      const SampleStream& stream);
+
+  // Traces the jittered samples of a pixel, tracing the primary rays as packets.
+  void accumulateSamples(const Scene& scene, const Camera& camera, int x, int y, const SampleStream& stream);
+
+  // Traces a path whose first ray has already been intersected with the scene, and returns its radiance.
+  Vec3 trace(const Scene& scene, const Ray& ray, const std::optional<Scene::Hit>& hit, const Sampler& sampler) const;
+
+  // Advances a path past its latest intersection: adds the (MIS weighted) emission found there and the
+  // light sampled directly from the sky and the emissive surfaces, then picks the next ray.
+  // Returns false once the path ends.
+  bool scatter(const Scene& scene, PathState& path, const std::optional<Scene::Hit>& hit) const;
+
+  Vec3 onMiss(const Ray& ray) const;
+
+  // Maps a pair of uniform numbers to a cosine weighted direction around the normal.
+  static Vec3 sampleHemisphere(const std::array<float, 2>& u, const Vec3& n);
+
+  // Picks a direction on the whole sphere with a density proportional to the luminance of the sky there.
+  Vec3 sampleSky(const std::array<float, 2>& u) const;
+
+  // The densities of the directions picked by BSDF sampling and by sky sampling.
+  static float bsdfPdf(const Vec3& n, const Vec3& dir);
+
+  float skyPdf(const Vec3& dir) const;
+
+  void skyLuminance(float& a, float& b) const;
 
 private:
-  std::vector<Rng> m_rngs;
+  bvh::v2::ThreadPool& m_threadPool;
+
+  // Random numbers are hashed from the seed, the frame, the stream, the pixel and the sample index, so
+  // the images do not depend on how the work is scheduled.
+  std::uint32_t m_seed;
+
+  std::uint32_t m_frame{ 0 };
+
+  // Recycles the images of the results from one frame to the next.
+  BufferPool m_buffers;
 
   const int m_width;
 
   const int m_height;
 
-  const int m_maxDepth{ 5 };
+  TileScheduler m_tiles;
+
+  Mode m_mode{ Mode::DepthFirst };
+
+  Sampling m_sampling;
+
+  // The number of paths a tile keeps in flight at once in wavefront mode.
+  const int m_wavefrontSize{ 8192 };
+
+  int m_maxDepth{ 5 };
+
+  // The depth at which Russian roulette starts terminating low throughput paths.
+  const int m_rouletteDepth{ 2 };
 
   const float m_minDistance{ 15.0f };
 
@@ -0,0 +1,106 @@
+#pragma once
+
+// Low discrepancy sample generation for the path tracer.
+//
+// Each call to the sampler draws the next dimension of an Owen scrambled Sobol sequence. Only the first two
+// Sobol dimensions are used: higher dimensions are padded by giving every pair of dimensions its own scramble
+// and its own shuffled sample order (Burley, "Practical Hash-based Owen Scrambling", 2020).
+
+#include <array>
+
+#include <cstdint>
+
+namespace sampling {
+
+inline std::uint32_t
+hash(std::uint32_t x)
+{
+  x ^= x >> 16;
+  x *= 0x21f0aaadu;
+  x ^= x >> 15;
+  x *= 0x735a2d97u;
+  x ^= x >> 15;
+  return x;
+}
+
+inline std::uint32_t
+hashCombine(const std::uint32_t seed, const std::uint32_t v)
+{
+  return hash(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+inline std::uint32_t
+reverseBits(std::uint32_t x)
+{
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+// Owen scrambles the bits of x, from the most significant down (Laine and Karras).
+inline std::uint32_t
+owenScramble(std::uint32_t x, const std::uint32_t seed)
+{
+  x = reverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverseBits(x);
+}
+
+// The first two dimensions of the Sobol sequence, as 32 bit fixed point numbers.
+inline std::array<std::uint32_t, 2>
+sobol(std::uint32_t index)
+{
+  std::uint32_t y{ 0 };
+  std::uint32_t v{ 1u << 31 };
+
+  for (auto i = index; i != 0; i >>= 1, v ^= v >> 1)
+    y ^= (0u - (i & 1u)) & v;
+
+  return { reverseBits(index), y };
+}
+
+inline float
+toFloat(const std::uint32_t x)
+{
+  return static_cast<float>(x >> 8) * (1.0f / 16777216.0f);
+}
+
+class Sampler final
+{
+public:
+  Sampler() = default;
+
+  // The seed decorrelates the sequences of different pixels, the index picks the sample within the sequence.
+  Sampler(const std::uint32_t seed, const std::uint32_t index)
+    : m_seed(seed)
+    , m_index(index)
+  {
+  }
+
+  float next1D() { return next2D()[0]; }
+
+  std::array<float, 2> next2D()
+  {
+    const auto seed = hashCombine(m_seed, m_dimension++);
+
+    const auto point = sobol(owenScramble(m_index, seed));
+
+    return { toFloat(owenScramble(point[0], hashCombine(seed, 0))),
+             toFloat(owenScramble(point[1], hashCombine(seed, 1))) };
+  }
+
+private:
+  std::uint32_t m_seed{ 0 };
+
+  std::uint32_t m_index{ 0 };
+
+  std::uint32_t m_dimension{ 0 };
+};
+
+} // namespace sampling
@@ -1,92 +1,555 @@
 #include "scene.h"
 
+#include "mapped_file.h"
+
+#include <glm/gtx/transform.hpp>
+
 #include <bvh/v2/default_builder.h>
 #include <bvh/v2/executor.h>
 #include <bvh/v2/thread_pool.h>
 
+#include <algorithm>
+#include <filesystem>
 #include <fstream>
+#include <iomanip>
+#include <limits>
 #include <random>
+#include <sstream>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 
+#include <cmath>
 #include <cstdint>
+#include <cstring>
 
 namespace {
 
-std::vector<uint8_t>
-read_whole_file(const char* path)
+using BBox = bvh::v2::BBox<float, 3>;
+
+void
+buildBlas(bvh::v2::ThreadPool& thread_pool, Model& model)
+{
+  bvh::v2::ParallelExecutor executor(thread_pool);
+
+  std::vector<BBox> bboxes(model.triangleCount());
+
+  std::vector<Model::Vec3> centers(model.triangleCount());
+
+  executor.for_each(0, model.triangleCount(), [&](const std::size_t begin, const std::size_t end) {
+    for (std::size_t i = begin; i < end; i++) {
+      const auto tri = model.triangle(i);
+      bboxes[i] = tri.get_bbox();
+      centers[i] = tri.get_center();
+    }
+  });
+
+  using Builder = bvh::v2::DefaultBuilder<Scene::Node>;
+
+  typename Builder::Config config;
+
+  config.quality = Builder::Quality::High;
+
+  const auto binary = Builder::build(thread_pool, bboxes, centers, config);
+
+  // Put the triangles in the order of the leaves, so that the leaves can refer to them directly, and number the
+  // vertices in the order those triangles first use them.
+
+  std::vector<std::array<std::uint32_t, 3>> indices(model.triangleCount());
+
+  for (std::size_t i = 0; i < indices.size(); i++)
+    indices[i] = model.indices[binary.prim_ids[i]];
+
+  constexpr auto unused = std::numeric_limits<std::uint32_t>::max();
+
+  std::vector<std::uint32_t> vertex_ids(model.positions.size(), unused);
+
+  std::vector<Model::Vec3> positions;
+
+  std::vector<std::uint32_t> normals;
+
+  positions.reserve(model.positions.size());
+
+  normals.reserve(model.normals.size());
+
+  for (auto& index : indices) {
+    for (auto& vertex : index) {
+      if (vertex_ids[vertex] == unused) {
+        vertex_ids[vertex] = static_cast<std::uint32_t>(positions.size());
+        positions.emplace_back(model.positions[vertex]);
+        normals.emplace_back(model.normals[vertex]);
+      }
+      vertex = vertex_ids[vertex];
+    }
+  }
+
+  model.indices = std::move(indices);
+
+  model.positions = std::move(positions);
+
+  model.normals = std::move(normals);
+
+  model.bvh = WideBvh::compress(binary);
+}
+
+// A fast 64 bit hash of a whole file, which names its entry in the model cache.
+std::uint64_t
+hashBytes(const unsigned char* data, const std::size_t size)
+{
+  constexpr std::uint64_t prime{ 0x9e3779b97f4a7c15ull };
+
+  std::uint64_t h{ size * prime };
+
+  std::size_t i{ 0 };
+
+  for (; (i + 8) <= size; i += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    h = (h ^ (word * prime)) * prime;
+    h ^= h >> 29;
+  }
+
+  for (; i < size; i++)
+    h = (h ^ data[i]) * prime;
+
+  return h ^ (h >> 32);
+}
+
+struct CacheHeader final
+{
+  char magic[8];
+
+  std::uint32_t version;
+
+  std::uint32_t reserved;
+
+  std::uint64_t triCount;
+
+  std::uint64_t vertexCount;
+
+  std::uint64_t nodeCount;
+
+  WideBvh::BBox bounds;
+};
+
+constexpr char cache_magic[8]{ 'G', 'E', 'N', 'M', 'E', 'S', 'H', '1' };
+
+// Changes whenever the layout of a model or its BVH does, so that stale entries are ignored.
+constexpr std::uint32_t cache_version{ 3 };
+
+static_assert(std::is_trivially_copyable_v<Model::Vec3> && std::is_trivially_copyable_v<WideBvh::Node>);
+
+template<typename T>
+void
+readArray(std::istream& file, std::vector<T>& values, const std::size_t count)
+{
+  values.resize(count);
+
+  file.read(reinterpret_cast<char*>(values.data()), static_cast<std::streamsize>(count * sizeof(T)));
+}
+
+// Adds the size of an array of 'count' values to 'total', or returns false if the sum is more than a stream can
+// read at once.
+template<typename T>
+bool
+addArraySize(std::uint64_t& total, const std::vector<T>&, const std::uint64_t count)
+{
+  constexpr auto limit = static_cast<std::uint64_t>(std::numeric_limits<std::streamsize>::max());
+
+  if ((total > limit) || (count > ((limit - total) / sizeof(T))))
+    return false;
+
+  total += count * sizeof(T);
+
+  return true;
+}
+
+template<typename T>
+void
+writeArray(std::ostream& file, const std::vector<T>& values)
+{
+  file.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(T)));
+}
+
+bool
+loadCachedModel(const std::filesystem::path& path, Model& model)
+{
+  std::ifstream file(path, std::ios::binary);
+
+  if (!file)
+    return false;
+
+  CacheHeader header{};
+
+  file.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+  if (!file || (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0) || (header.version != cache_version))
+    return false;
+
+  // The counts are checked against the size of the file before anything is allocated for them, so that a damaged
+  // header can not ask for more memory than the entry holds.
+
+  std::uint64_t expected_size{ sizeof(header) };
+
+  if (!addArraySize(expected_size, model.positions, header.vertexCount) ||
+      !addArraySize(expected_size, model.normals, header.vertexCount) ||
+      !addArraySize(expected_size, model.indices, header.triCount) ||
+      !addArraySize(expected_size, model.bvh.nodes, header.nodeCount))
+    return false;
+
+  std::error_code error;
+
+  const auto file_size = std::filesystem::file_size(path, error);
+
+  if (error || (file_size != expected_size))
+    return false;
+
+  const auto count = static_cast<std::size_t>(header.triCount);
+
+  const auto vertex_count = static_cast<std::size_t>(header.vertexCount);
+
+  const auto node_count = static_cast<std::size_t>(header.nodeCount);
+
+  try {
+    readArray(file, model.positions, vertex_count);
+    readArray(file, model.normals, vertex_count);
+    readArray(file, model.indices, count);
+    readArray(file, model.bvh.nodes, node_count);
+  } catch (const std::exception&) {
+    return false;
+  }
+
+  model.bvh.bounds = header.bounds;
+
+  if (!file || model.bvh.nodes.empty())
+    return false;
+
+  // A damaged entry must not send traversal out of bounds.
+
+  for (const auto& index : model.indices) {
+    if ((index[0] >= vertex_count) || (index[1] >= vertex_count) || (index[2] >= vertex_count))
+      return false;
+  }
+
+  // Inner children come after their parent, which also rules out cycles.
+
+  for (std::size_t node_index = 0; node_index < node_count; node_index++) {
+
+    const auto& node = model.bvh.nodes[node_index];
+
+    if (node.childCount > WideBvh::arity)
+      return false;
+
+    for (int i = 0; i < node.childCount; i++) {
+      const auto end = static_cast<std::size_t>(node.child[i]) + node.primCount[i];
+      if ((node.primCount[i] == 0) ? ((node.child[i] <= node_index) || (node.child[i] >= node_count)) : (end > count))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+// Writes to a temporary file first, so that processes sharing the cache never read a partial entry.
+void
+saveCachedModel(const std::filesystem::path& path, const Model& model)
 {
-  std::vector<uint8_t> data;
+  std::error_code error;
+
+  std::filesystem::create_directories(path.parent_path(), error);
+
+  auto temporary = path;
+
+  temporary += "." + std::to_string(std::random_device()()) + ".tmp";
+
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+
+    if (!file)
+      return;
+
+    CacheHeader header{};
+
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+
+    header.version = cache_version;
+
+    header.triCount = model.triangleCount();
+
+    header.vertexCount = model.positions.size();
+
+    header.nodeCount = model.bvh.nodes.size();
 
-  std::ifstream file(path, std::ios::binary | std::ios::in);
+    header.bounds = model.bvh.bounds;
 
-  if (!file.good())
-    return data;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
 
-  file.seekg(0, std::ios::end);
+    writeArray(file, model.positions);
+    writeArray(file, model.normals);
+    writeArray(file, model.indices);
+    writeArray(file, model.bvh.nodes);
 
-  const auto file_end = file.tellg();
+    if (!file) {
+      file.close();
+      std::filesystem::remove(temporary, error);
+      return;
+    }
+  }
+
+  std::filesystem::rename(temporary, path, error);
+
+  if (error)
+    std::filesystem::remove(temporary, error);
+}
+
+// Decodes the corners of the 50 byte triangle records of a binary STL file, in parallel for large meshes.
+// The normals of the records are ignored, since many exporters leave them out.
+std::vector<Model::Vec3>
+decodeStl(bvh::v2::ThreadPool& thread_pool, const unsigned char* records, const std::size_t tri_count)
+{
+  constexpr std::size_t bytes_per_tri = 50;
+
+  std::vector<Model::Vec3> corners(tri_count * 3);
 
-  if (file_end == -1l)
-    return data;
+  auto decode = [&](const std::size_t begin, const std::size_t end) {
+    for (std::size_t i = begin; i < end; i++) {
 
-  file.seekg(0, std::ios::beg);
+      // Records are not aligned, so the floats are copied out.
+      float v[12];
 
-  const auto file_size = static_cast<std::size_t>(file_end);
+      std::memcpy(v, records + i * bytes_per_tri, sizeof(v));
 
-  data.resize(file_size);
+      // Adding zero turns -0 into +0, so that both weld together.
+      for (int k = 0; k < 3; k++)
+        corners[i * 3 + k] = Model::Vec3(v[3 + k * 3] + 0.0f, v[4 + k * 3] + 0.0f, v[5 + k * 3] + 0.0f);
+    }
+  };
 
-  file.read(reinterpret_cast<char*>(data.data()), data.size());
+  constexpr std::size_t parallel_threshold{ 65536 };
 
-  return data;
+  if (tri_count < parallel_threshold) {
+    decode(0, tri_count);
+  } else {
+    bvh::v2::ParallelExecutor executor(thread_pool);
+    executor.for_each(0, tri_count, decode);
+  }
+
+  return corners;
+}
+
+struct PositionHash final
+{
+  std::size_t operator()(const Model::Vec3& p) const
+  {
+    const float values[3]{ p[0], p[1], p[2] };
+
+    return static_cast<std::size_t>(hashBytes(reinterpret_cast<const unsigned char*>(values), sizeof(values)));
+  }
+};
+
+struct PositionEqual final
+{
+  bool operator()(const Model::Vec3& a, const Model::Vec3& b) const
+  {
+    return (a[0] == b[0]) && (a[1] == b[1]) && (a[2] == b[2]);
+  }
+};
+
+// Merges the corners that share a position into indexed vertices with smooth normals.
+//
+// The corners at a position are grouped by the normals of their faces: a face joins the first group whose
+// first face is less than the crease angle away, or starts a group of its own. Each group becomes a vertex,
+// whose normal is the area weighted sum of the normals of its faces.
+void
+weld(const std::vector<Model::Vec3>& corners, const float crease_angle, Model& model)
+{
+  using Vec3 = Model::Vec3;
+
+  const auto tri_count = corners.size() / 3;
+
+  std::vector<Vec3> face_normals(tri_count);
+
+  for (std::size_t i = 0; i < tri_count; i++)
+    face_normals[i] = cross(corners[i * 3 + 1] - corners[i * 3], corners[i * 3 + 2] - corners[i * 3]);
+
+  // Number the distinct positions, then list the corners at each of them.
+
+  std::vector<std::uint32_t> position_ids(corners.size());
+
+  std::vector<std::uint32_t> position_offsets;
+
+  {
+    std::unordered_map<Vec3, std::uint32_t, PositionHash, PositionEqual> ids;
+
+    ids.reserve(corners.size() / 2);
+
+    for (std::size_t i = 0; i < corners.size(); i++) {
+      const auto it = ids.emplace(corners[i], static_cast<std::uint32_t>(ids.size())).first;
+      position_ids[i] = it->second;
+    }
+
+    position_offsets.assign(ids.size() + 1, 0);
+  }
+
+  for (const auto id : position_ids)
+    position_offsets[id + 1]++;
+
+  for (std::size_t i = 1; i < position_offsets.size(); i++)
+    position_offsets[i] += position_offsets[i - 1];
+
+  std::vector<std::uint32_t> corners_by_position(corners.size());
+
+  {
+    auto next = position_offsets;
+
+    for (std::size_t i = 0; i < corners.size(); i++)
+      corners_by_position[next[position_ids[i]]++] = static_cast<std::uint32_t>(i);
+  }
+
+  const auto min_cos = std::cos(crease_angle * (3.14159265f / 180.0f));
+
+  model.indices.resize(tri_count);
+
+  model.positions.clear();
+
+  std::vector<Vec3> sums;
+
+  // The first face of each group at the current position, and the vertex it became.
+  std::vector<std::pair<Vec3, std::uint32_t>> groups;
+
+  for (std::size_t p = 0; (p + 1) < position_offsets.size(); p++) {
+
+    groups.clear();
+
+    for (auto k = position_offsets[p]; k < position_offsets[p + 1]; k++) {
+
+      const auto corner = corners_by_position[k];
+
+      const auto& face = face_normals[corner / 3];
+
+      const auto face_length = length(face);
+
+      const auto n = (face_length > 0.0f) ? face * (1.0f / face_length) : face;
+
+      // Degenerate faces have no normal of their own, so they join the first group, and a group started by
+      // one takes the normal of the next face that joins it.
+      auto it = std::find_if(groups.begin(), groups.end(), [&](const std::pair<Vec3, std::uint32_t>& group) {
+        return (face_length <= 0.0f) || (dot(group.first, group.first) == 0.0f) || (dot(group.first, n) >= min_cos);
+      });
+
+      if ((it != groups.end()) && (dot(it->first, it->first) == 0.0f))
+        it->first = n;
+
+      if (it == groups.end()) {
+        groups.emplace_back(n, static_cast<std::uint32_t>(model.positions.size()));
+        model.positions.emplace_back(corners[corner]);
+        sums.emplace_back(Vec3(0, 0, 0));
+        it = groups.end() - 1;
+      }
+
+      sums[it->second] = sums[it->second] + face;
+
+      model.indices[corner / 3][corner % 3] = it->second;
+    }
+  }
+
+  model.normals.resize(sums.size());
+
+  for (std::size_t i = 0; i < sums.size(); i++) {
+    const auto sum_length = length(sums[i]);
+    model.normals[i] = Model::packNormal((sum_length > 0.0f) ? sums[i] * (1.0f / sum_length) : Vec3(0, 1, 0));
+  }
+}
+
+BBox
+transformBBox(const BBox& bbox, const glm::mat4& transform)
+{
+  auto result = BBox::make_empty();
+
+  for (int i = 0; i < 8; i++) {
+    const auto x = (i & 1) ? bbox.max[0] : bbox.min[0];
+    const auto y = (i & 2) ? bbox.max[1] : bbox.min[1];
+    const auto z = (i & 4) ? bbox.max[2] : bbox.min[2];
+    const auto p = transform * glm::vec4(x, y, z, 1.0f);
+    result.extend(Scene::Vec3(p.x, p.y, p.z));
+  }
+
+  return result;
+}
+
+// The expected cost of tracing a ray through the tree, counting node visits and primitive tests alike, for
+// rays that hit the root.
+float
+sahCost(const Scene::Bvh& bvh)
+{
+  const auto root_area = bvh.get_root().get_bbox().get_half_area();
+
+  if (!(root_area > 0.0f))
+    return 0.0f;
+
+  auto cost = 0.0f;
+
+  for (const auto& node : bvh.nodes) {
+    const auto weight = node.index.is_leaf() ? static_cast<float>(node.index.prim_count()) : 1.0f;
+    cost += node.get_bbox().get_half_area() * weight;
+  }
+
+  return cost / root_area;
 }
 
 } // namespace
 
+Scene::Scene(bvh::v2::ThreadPool& threadPool)
+  : m_threadPool(threadPool)
+{
+}
+
+Scene::Scene(bvh::v2::ThreadPool& threadPool, const Scene& models)
+  : m_threadPool(threadPool)
+  , m_models(models.m_models)
+{
+}
+
 bool
 Scene::loadModel(const char* path, const Vec3& albedo, const Vec3& emission, const Vec3& segmentation)
 {
-  const auto data{ read_whole_file(path) };
+  const MappedFile file(path);
 
   constexpr std::size_t header_size{ 84 };
 
-  if (data.size() < header_size)
+  if (!file || (file.size() < header_size))
     return false;
 
-  const std::size_t tri_count{ *reinterpret_cast<const std::uint32_t*>(data.data() + 80) };
+  std::uint32_t tri_count{ 0 };
+
+  std::memcpy(&tri_count, file.data() + 80, sizeof(tri_count));
 
   constexpr std::size_t bytes_per_tri = 50;
 
-  if (data.size() < (header_size + bytes_per_tri * tri_count))
+  if ((tri_count == 0) || (file.size() < (header_size + bytes_per_tri * tri_count)))
     return false;
 
   Model model;
 
-  for (std::size_t i = 0; i < tri_count; i++) {
+  std::filesystem::path cache_path;
 
-    const float* tri_ptr = reinterpret_cast<const float*>(data.data() + header_size + i * bytes_per_tri);
-
-    const float norm_x = tri_ptr[0];
-    const float norm_y = tri_ptr[1];
-    const float norm_z = tri_ptr[2];
-
-    const float a_x = tri_ptr[3];
-    const float a_y = tri_ptr[4];
-    const float a_z = tri_ptr[5];
-
-    const float b_x = tri_ptr[6];
-    const float b_y = tri_ptr[7];
-    const float b_z = tri_ptr[8];
+  if (!m_cacheDirectory.empty()) {
+    std::ostringstream name;
+    // The crease angle changes the welded mesh, so it is part of the name.
+    const auto crease_hash = hashBytes(reinterpret_cast<const unsigned char*>(&m_creaseAngle), sizeof(m_creaseAngle));
+    name << std::hex << std::setw(16) << std::setfill('0') << (hashBytes(file.data(), file.size()) ^ crease_hash)
+         << ".mesh";
+    cache_path = std::filesystem::path(m_cacheDirectory) / name.str();
+  }
 
-    const float c_x = tri_ptr[9];
-    const float c_y = tri_ptr[10];
-    const float c_z = tri_ptr[11];
+  if (cache_path.empty() || !loadCachedModel(cache_path, model)) {
 
-    const auto a = Vec3(a_x, a_y, a_z);
-    const auto b = Vec3(b_x, b_y, b_z);
-    const auto c = Vec3(c_x, c_y, c_z);
+    weld(decodeStl(m_threadPool, file.data() + header_size, tri_count), m_creaseAngle, model);
 
-    model.normals.emplace_back(Vec3(norm_x, norm_y, norm_z));
+    buildBlas(m_threadPool, model);
 
-    model.primitives.emplace_back(Model::Tri(a, b, c));
+    if (!cache_path.empty())
+      saveCachedModel(cache_path, model);
   }
 
   model.albedo = albedo;
@@ -95,11 +558,36 @@ Scene::loadModel(const char* path, const Vec3& albedo, const Vec3& emission, con
 
   model.segmentation = segmentation;
 
-  m_models.emplace_back(std::move(model));
+  m_models.emplace_back(std::make_shared<const Model>(std::move(model)));
 
   return true;
 }
 
+std::uint32_t
+Model::packNormal(const Vec3& n)
+{
+  // Project onto the octahedron |x| + |y| + |z| = 1, and fold its lower half over the upper one.
+
+  const auto sum = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+
+  auto x = n[0] / sum;
+  auto y = n[1] / sum;
+
+  if (n[2] < 0.0f) {
+    const auto folded_x = (1.0f - std::abs(y)) * ((x >= 0.0f) ? 1.0f : -1.0f);
+    const auto folded_y = (1.0f - std::abs(x)) * ((y >= 0.0f) ? 1.0f : -1.0f);
+    x = folded_x;
+    y = folded_y;
+  }
+
+  auto quantize = [](const float value) {
+    const auto q = static_cast<std::int32_t>(std::lround(std::clamp(value, -1.0f, 1.0f) * 32767.0f));
+    return static_cast<std::uint32_t>(static_cast<std::uint16_t>(static_cast<std::int16_t>(q)));
+  };
+
+  return quantize(x) | (quantize(y) << 16);
+}
+
 namespace {
 
 bool
@@ -122,6 +610,74 @@ is_empty_spot(const std::vector<Scene::Vec3>& spots, const Scene::Vec3& spot, co
 
 } // namespace
 
+std::vector<std::size_t>
+Scene::randomize(const Placement& placement, const int count, const int seed)
+{
+  if ((placement.modelCount == 0) || (count <= 0))
+    return {};
+
+  std::mt19937 rng(static_cast<std::uint32_t>(seed));
+
+  std::uniform_int_distribution<std::size_t> model_dist(placement.modelOffset,
+                                                        placement.modelOffset + placement.modelCount - 1);
+  std::uniform_real_distribution<float> x_dist(placement.min[0], placement.max[0]);
+  std::uniform_real_distribution<float> y_dist(placement.min[1], placement.max[1]);
+  std::uniform_real_distribution<float> z_dist(placement.min[2], placement.max[2]);
+  std::uniform_real_distribution<float> angle_dist(0.0f, 360.0f);
+
+  // The objects already in the scene keep their spots.
+
+  std::vector<Vec3> spots;
+
+  for (const auto& inst : m_instances) {
+    if (inst.objectMask)
+      spots.emplace_back(Vec3(inst.transform[3][0], inst.transform[3][1], inst.transform[3][2]));
+  }
+
+  std::vector<std::size_t> added;
+
+  constexpr int max_attempts{ 64 };
+
+  for (int i = 0; i < count; i++) {
+
+    for (int attempt = 0; attempt < max_attempts; attempt++) {
+
+      const Vec3 spot(x_dist(rng), y_dist(rng), z_dist(rng));
+
+      if (!is_empty_spot(spots, spot, placement.spacing))
+        continue;
+
+      spots.emplace_back(spot);
+
+      const auto transform = glm::translate(glm::vec3(spot[0], spot[1], spot[2])) *
+                             glm::rotate(glm::radians(angle_dist(rng)), glm::vec3(0, 1, 0));
+
+      added.emplace_back(instanceSingle(model_dist(rng), transform, std::nullopt, true));
+
+      break;
+    }
+  }
+
+  return added;
+}
+
+namespace {
+
+float
+luminance(const Scene::Vec3& c)
+{
+  return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+Scene::Vec3
+transformPoint(const glm::mat4& transform, const Scene::Vec3& p)
+{
+  const auto q = transform * glm::vec4(p[0], p[1], p[2], 1.0f);
+  return Scene::Vec3(q.x, q.y, q.z);
+}
+
+} // namespace
+
 void
 Scene::instanceRange(const std::size_t offset,
                      const std::size_t count,
@@ -130,69 +686,516 @@ Scene::instanceRange(const std::size_t offset,
                      const bool objectMask)
 {
   for (std::size_t i = 0; i < count; i++)
-    instance(m_models[i + offset], transform, albedoOverride, objectMask);
+    instance(i + offset, transform, albedoOverride, objectMask);
+}
+
+void
+Scene::instance(const std::size_t model,
+                const glm::mat4& transform,
+                const std::optional<Vec3>& albedoOverride,
+                const bool objectMask)
+{
+  const auto albedo = albedoOverride.has_value() ? albedoOverride.value() : m_models[model]->albedo;
+
+  m_instances.emplace_back(Instance{ model, glm::mat4(1.0f), glm::mat4(1.0f), glm::mat3(1.0f), albedo, objectMask });
+
+  m_instancesChanged = true;
+
+  setInstanceTransform(m_instances.size() - 1, transform);
+}
+
+void
+Scene::setInstanceTransform(const std::size_t instance, const glm::mat4& transform)
+{
+  auto& inst = m_instances[instance];
+
+  inst.transform = transform;
+
+  inst.inverseTransform = glm::inverse(transform);
+
+  inst.normalTransform = glm::transpose(glm::mat3(inst.inverseTransform));
+
+  if (luminance(m_models[inst.model]->emission) > 0.0f)
+    m_lightsChanged = true;
+}
+
+void
+Scene::commit(const Quality quality)
+{
+  // The lights are only gathered again when one of them moved, since the moving objects rarely emit.
+
+  if (m_instancesChanged || m_lightsChanged)
+    gatherLights();
+
+  m_lightsChanged = false;
+
+  if (m_instances.empty()) {
+    m_bvh = Bvh();
+    m_traversal.clear();
+    m_instancesChanged = false;
+    return;
+  }
+
+  // Only the top level is built here, the per-model BVHs were built in loadModel.
+
+  auto instance_bbox = [this](const std::size_t i) {
+    const auto& instance = m_instances[i];
+    return transformBBox(m_models[instance.model]->bvh.bounds, instance.transform);
+  };
+
+  if (!m_instancesChanged && !m_bvh.nodes.empty()) {
+
+    m_bvh.refit([&](Node& leaf) {
+      auto bbox = BBox::make_empty();
+      for (std::size_t i = 0; i < leaf.index.prim_count(); i++)
+        bbox.extend(instance_bbox(m_bvh.prim_ids[leaf.index.first_id() + i]));
+      leaf.set_bbox(bbox);
+    });
+
+    // Moving an object far from where it was built stretches the nodes above it over empty space, which
+    // every ray through that space pays for. Past this point a new build is cheaper than the slower traversal.
+
+    constexpr float max_cost_ratio{ 1.5f };
+
+    if (sahCost(m_bvh) <= (m_bvhCost * max_cost_ratio)) {
+      gatherTraversalInstances();
+      return;
+    }
+  }
+
+  std::vector<BBox> bboxes(m_instances.size());
+
+  std::vector<Vec3> centers(m_instances.size());
+
+  for (std::size_t i = 0; i < m_instances.size(); i++) {
+    bboxes[i] = instance_bbox(i);
+    centers[i] = bboxes[i].get_center();
+  }
+
+  using Builder = bvh::v2::DefaultBuilder<Node>;
+
+  typename Builder::Config config;
+
+  switch (quality) {
+    case Quality::Low:
+      config.quality = Builder::Quality::Low;
+      break;
+    case Quality::Medium:
+      config.quality = Builder::Quality::Medium;
+      break;
+    case Quality::High:
+      config.quality = Builder::Quality::High;
+      break;
+  }
+
+  m_bvh = Builder::build(bboxes, centers, config);
+
+  m_bvhCost = sahCost(m_bvh);
+
+  m_instancesChanged = false;
+
+  gatherTraversalInstances();
+}
+
+void
+Scene::gatherTraversalInstances()
+{
+  m_traversal.resize(m_bvh.prim_ids.size());
+
+  for (std::size_t i = 0; i < m_traversal.size(); i++) {
+    const auto j = m_bvh.prim_ids[i];
+    const auto& instance = m_instances[j];
+    m_traversal[i] =
+      TraversalInstance{ instance.inverseTransform, m_models[instance.model].get(), static_cast<std::uint32_t>(j) };
+  }
+}
+
+void
+Scene::gatherLights()
+{
+  m_lights.clear();
+
+  m_lightCdf.clear();
+
+  auto power = 0.0f;
+
+  for (const auto& instance : m_instances) {
+
+    const auto& model = *m_models[instance.model];
+
+    if (luminance(model.emission) <= 0.0f)
+      continue;
+
+    for (std::size_t i = 0; i < model.triangleCount(); i++) {
+
+      const auto world_tri = model.triangle(i);
+
+      const auto p0 = transformPoint(instance.transform, world_tri.p0);
+      const auto p1 = transformPoint(instance.transform, world_tri.p1);
+      const auto p2 = transformPoint(instance.transform, world_tri.p2);
+
+      const auto n = cross(p1 - p0, p2 - p0);
+
+      const auto area = 0.5f * length(n);
+
+      if (area <= 0.0f)
+        continue;
+
+      power += area * luminance(model.emission);
+
+      m_lights.emplace_back(Light{ p0, p1, p2, n * (0.5f / area), model.emission });
+
+      m_lightCdf.emplace_back(power);
+    }
+  }
+}
+
+auto
+Scene::sampleLight(const float u0, const float u1, const float u2) const -> LightSample
+{
+  const auto total = m_lightCdf.back();
+
+  const auto it = std::upper_bound(m_lightCdf.begin(), m_lightCdf.end(), u0 * total);
+
+  const auto index = std::min<std::size_t>(std::distance(m_lightCdf.begin(), it), m_lights.size() - 1);
+
+  const auto& light = m_lights[index];
+
+  // Uniform point on the triangle.
+
+  const auto s = std::sqrt(u1);
+
+  const auto b0 = 1.0f - s;
+  const auto b1 = u2 * s;
+
+  const auto position = light.p0 * b0 + light.p1 * b1 + light.p2 * (1.0f - b0 - b1);
+
+  // Lights are picked by power = area * luminance, so the density per unit area only depends on the luminance.
+
+  return LightSample{ position, light.normal, light.emission, luminance(light.emission) / total };
+}
+
+float
+Scene::lightPdf(const Vec3& emission, const Vec3& faceNormal, const Vec3& dir, const float distance) const
+{
+  const auto cos_light = std::abs(dot(faceNormal, dir));
+
+  if (m_lightCdf.empty() || (cos_light <= 0.0f))
+    return 0.0f;
+
+  return (luminance(emission) / m_lightCdf.back()) * distance * distance / cos_light;
 }
 
 namespace {
 
-bvh::v2::PrecomputedTri<float>
-instanceTri(const bvh::v2::Tri<float, 3>& tri, const glm::mat4& transform)
+struct PacketRay final
+{
+  simd::Float org[3];
+
+  simd::Float dir[3];
+
+  simd::Float invDir[3];
+
+  simd::Float tmin;
+
+  simd::Float tmax;
+};
+
+PacketRay
+transformPacket(const PacketRay& ray, const glm::mat4& m)
 {
-  const auto p0 = transform * glm::vec4(tri.p0[0], tri.p0[1], tri.p0[2], 1.0f);
-  const auto p1 = transform * glm::vec4(tri.p1[0], tri.p1[1], tri.p1[2], 1.0f);
-  const auto p2 = transform * glm::vec4(tri.p2[0], tri.p2[1], tri.p2[2], 1.0f);
+  using simd::broadcast;
+
+  PacketRay result;
+
+  for (int i = 0; i < 3; i++) {
+    const auto x = broadcast(m[0][i]);
+    const auto y = broadcast(m[1][i]);
+    const auto z = broadcast(m[2][i]);
+    result.org[i] = x * ray.org[0] + y * ray.org[1] + z * ray.org[2] + broadcast(m[3][i]);
+    result.dir[i] = x * ray.dir[0] + y * ray.dir[1] + z * ray.dir[2];
+    result.invDir[i] = broadcast(1.0f) / result.dir[i];
+  }
 
-  using Vec3 = bvh::v2::Vec<float, 3>;
+  result.tmin = ray.tmin;
 
-  return bvh::v2::Tri<float, 3>(Vec3(p0.x, p0.y, p0.z), Vec3(p1.x, p1.y, p1.z), Vec3(p2.x, p2.y, p2.z));
+  result.tmax = ray.tmax;
+
+  return result;
 }
 
-} // namespace
+// Slab test of every lane against the node bounds.
+// The entry distance is the closest one among the lanes that hit.
+simd::Mask
+intersectNode(const BBox& bbox, const PacketRay& ray, float& entry)
+{
+  auto tNear = ray.tmin;
+  auto tFar = ray.tmax;
+
+  for (int i = 0; i < 3; i++) {
+    const auto t0 = (simd::broadcast(bbox.min[i]) - ray.org[i]) * ray.invDir[i];
+    const auto t1 = (simd::broadcast(bbox.max[i]) - ray.org[i]) * ray.invDir[i];
+    tNear = simd::max(tNear, simd::min(t0, t1));
+    tFar = simd::min(tFar, simd::max(t0, t1));
+  }
+
+  const auto hit = tNear <= tFar;
+
+  const auto mask = simd::bits(hit);
+
+  entry = std::numeric_limits<float>::infinity();
 
+  if (mask != 0) {
+    alignas(32) float near[simd::width];
+    simd::store(near, tNear);
+    for (int i = 0; i < simd::width; i++) {
+      if (mask & (1 << i))
+        entry = std::min(entry, near[i]);
+    }
+  }
+
+  return hit;
+}
+
+// Same test as bvh::v2::PrecomputedTri::intersect, for every lane at once.
+// Shortens the lanes that hit and returns them.
+simd::Mask
+intersectTri(const Model::Tri& tri, PacketRay& ray, simd::Float& hit_u, simd::Float& hit_v)
+{
+  using simd::broadcast;
+
+  const auto cx = broadcast(tri.p0[0]) - ray.org[0];
+  const auto cy = broadcast(tri.p0[1]) - ray.org[1];
+  const auto cz = broadcast(tri.p0[2]) - ray.org[2];
+
+  const auto rx = ray.dir[1] * cz - ray.dir[2] * cy;
+  const auto ry = ray.dir[2] * cx - ray.dir[0] * cz;
+  const auto rz = ray.dir[0] * cy - ray.dir[1] * cx;
+
+  const auto nx = broadcast(tri.n[0]);
+  const auto ny = broadcast(tri.n[1]);
+  const auto nz = broadcast(tri.n[2]);
+
+  const auto invDet = broadcast(1.0f) / (nx * ray.dir[0] + ny * ray.dir[1] + nz * ray.dir[2]);
+
+  const auto u = (rx * broadcast(tri.e2[0]) + ry * broadcast(tri.e2[1]) + rz * broadcast(tri.e2[2])) * invDet;
+  const auto v = (rx * broadcast(tri.e1[0]) + ry * broadcast(tri.e1[1]) + rz * broadcast(tri.e1[2])) * invDet;
+  const auto w = broadcast(1.0f) - u - v;
+
+  const auto t = (nx * cx + ny * cy + nz * cz) * invDet;
+
+  const auto tolerance = broadcast(-std::numeric_limits<float>::epsilon());
+
+  const auto hit = (u >= tolerance) & (v >= tolerance) & (w >= tolerance) & (t >= ray.tmin) & (t <= ray.tmax);
+
+  ray.tmax = simd::select(hit, t, ray.tmax);
+
+  hit_u = simd::select(hit, u, hit_u);
+
+  hit_v = simd::select(hit, v, hit_v);
+
+  return hit;
+}
+
+// Visits every leaf that at least one lane of the packet enters, near child first.
+template<typename LeafFn>
 void
-Scene::instance(const Model& model,
-                const glm::mat4& transform,
-                const std::optional<Vec3>& albedoOverride,
-                const bool objectMask)
+traversePacket(const Scene::Bvh& bvh, const PacketRay& ray, LeafFn&& leaf_fn)
 {
-  const auto albedo = albedoOverride.has_value() ? albedoOverride.value() : model.albedo;
+  constexpr std::size_t stack_size{ 64 };
+
+  bvh::v2::SmallStack<Scene::Bvh::Index, stack_size> stack;
+
+  stack.push(bvh.get_root().index);
+
+  while (!stack.is_empty()) {
+
+    auto top = stack.pop();
+
+    auto is_leaf_hit{ true };
 
-  for (std::size_t i = 0; i < model.primitives.size(); i++) {
+    while (top.prim_count() == 0) {
 
-    const auto t = instanceTri(model.primitives[i], transform);
+      const auto& left = bvh.nodes[top.first_id()];
+      const auto& right = bvh.nodes[top.first_id() + 1];
 
-    m_primitives.emplace_back(t);
+      float entry_left{ 0 };
+      float entry_right{ 0 };
 
-    m_attributes.emplace_back(Attributes{ model.normals[i], albedo, model.emission, model.segmentation, objectMask });
+      const auto hit_left = simd::bits(intersectNode(left.get_bbox(), ray, entry_left)) != 0;
+      const auto hit_right = simd::bits(intersectNode(right.get_bbox(), ray, entry_right)) != 0;
+
+      if (hit_left && hit_right) {
+        const auto right_first = entry_right < entry_left;
+        top = right_first ? right.index : left.index;
+        stack.push(right_first ? left.index : right.index);
+      } else if (hit_left) {
+        top = left.index;
+      } else if (hit_right) {
+        top = right.index;
+      } else {
+        is_leaf_hit = false;
+        break;
+      }
+    }
+
+    if (is_leaf_hit)
+      leaf_fn(top.first_id(), top.first_id() + top.prim_count());
   }
 }
 
+template<typename LeafFn>
 void
-Scene::commit()
+traversePacket(const WideBvh& bvh, const PacketRay& ray, LeafFn&& leaf_fn)
 {
-  using BBox = bvh::v2::BBox<float, 3>;
+  if (bvh.empty())
+    return;
+
+  struct Entry final
+  {
+    std::uint32_t index;
+
+    std::uint32_t primCount;
+  };
+
+  // As in WideBvh::intersect, a tree too deep for the stack loses its farthest children.
+  constexpr std::size_t stack_size{ 256 };
+
+  std::array<Entry, stack_size> stack;
+
+  std::size_t stack_top{ 0 };
+
+  stack[stack_top++] = Entry{ 0, 0 };
+
+  while (stack_top > 0) {
+
+    auto entry = stack[--stack_top];
+
+    while (entry.primCount == 0) {
+
+      const auto& node = bvh.nodes[entry.index];
 
-  if (m_primitives.empty())
+      // The children at least one lane enters, sorted from the farthest to the nearest.
+
+      Entry hits[WideBvh::arity];
+
+      float distances[WideBvh::arity];
+
+      int hit_count{ 0 };
+
+      for (int i = 0; i < node.childCount; i++) {
+
+        float distance{ 0 };
+
+        if (simd::bits(intersectNode(node.childBounds(i), ray, distance)) == 0)
+          continue;
+
+        auto k = hit_count++;
+
+        for (; (k > 0) && (distances[k - 1] < distance); k--) {
+          hits[k] = hits[k - 1];
+          distances[k] = distances[k - 1];
+        }
+
+        hits[k] = Entry{ node.child[i], node.primCount[i] };
+        distances[k] = distance;
+      }
+
+      if (hit_count == 0)
+        break;
+
+      const auto first = std::max(0, (hit_count - 1) - static_cast<int>(stack_size - stack_top));
+
+      for (int k = first; k < (hit_count - 1); k++)
+        stack[stack_top++] = hits[k];
+
+      entry = hits[hit_count - 1];
+    }
+
+    if (entry.primCount != 0)
+      leaf_fn(entry.index, entry.index + entry.primCount);
+  }
+}
+
+} // namespace
+
+void
+Scene::intersect(RayPacket& packet, PacketHits& hits) const
+{
+  for (auto& hit : hits)
+    hit.reset();
+
+  if (m_bvh.nodes.empty())
     return;
 
-  bvh::v2::ThreadPool thread_pool;
+  PacketRay ray;
 
-  bvh::v2::ParallelExecutor executor(thread_pool);
+  for (int i = 0; i < 3; i++) {
+    ray.org[i] = simd::load(packet.org[i]);
+    ray.dir[i] = simd::load(packet.dir[i]);
+    ray.invDir[i] = simd::broadcast(1.0f) / ray.dir[i];
+  }
+
+  ray.tmin = simd::load(packet.tmin);
+
+  ray.tmax = simd::load(packet.tmax);
+
+  constexpr auto invalid_id = std::numeric_limits<std::size_t>::max();
 
-  std::vector<BBox> bboxes(m_primitives.size());
+  std::array<std::size_t, packetSize> instance_ids;
 
-  std::vector<Vec3> centers(m_primitives.size());
+  std::array<std::size_t, packetSize> primitive_ids;
 
-  executor.for_each(0, m_primitives.size(), [&](const std::size_t begin, const std::size_t end) {
+  instance_ids.fill(invalid_id);
+
+  auto hit_u = simd::broadcast(0.0f);
+
+  auto hit_v = simd::broadcast(0.0f);
+
+  traversePacket(m_bvh, ray, [&](const std::size_t begin, const std::size_t end) {
     for (std::size_t i = begin; i < end; i++) {
-      bboxes[i] = m_primitives[i].get_bbox();
-      centers[i] = m_primitives[i].get_center();
+
+      const auto& instance = m_traversal[i];
+
+      const auto& model = *instance.model;
+
+      auto local_ray = transformPacket(ray, instance.inverseTransform);
+
+      traversePacket(model.bvh, local_ray, [&](const std::size_t prim_begin, const std::size_t prim_end) {
+        for (std::size_t primitive_id = prim_begin; primitive_id < prim_end; primitive_id++) {
+          const auto tri = Model::Tri(model.triangle(primitive_id));
+          const auto mask = simd::bits(intersectTri(tri, local_ray, hit_u, hit_v));
+          for (int lane = 0; lane < packetSize; lane++) {
+            if (mask & (1 << lane)) {
+              instance_ids[lane] = instance.instance;
+              primitive_ids[lane] = primitive_id;
+            }
+          }
+        }
+      });
+
+      ray.tmax = local_ray.tmax;
     }
   });
 
-  typename bvh::v2::DefaultBuilder<Node>::Config config;
+  simd::store(packet.tmax, ray.tmax);
+
+  alignas(32) float u[packetSize];
+
+  alignas(32) float v[packetSize];
 
-  config.quality = bvh::v2::DefaultBuilder<Node>::Quality::High;
+  simd::store(u, hit_u);
 
-  m_bvh = bvh::v2::DefaultBuilder<Node>::build(thread_pool, bboxes, centers, config);
+  simd::store(v, hit_v);
+
+  for (int lane = 0; lane < packetSize; lane++) {
+    if (instance_ids[lane] != invalid_id) {
+      const Vec3 dir(packet.dir[0][lane], packet.dir[1][lane], packet.dir[2][lane]);
+      const Intersection intersection{ static_cast<std::uint32_t>(instance_ids[lane]),
+                                       static_cast<std::uint32_t>(primitive_ids[lane]),
+                                       u[lane],
+                                       v[lane] };
+      hits[lane] = hit(intersection, dir);
+    }
+  }
 }
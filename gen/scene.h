@@ -1,33 +1,87 @@
 #pragma once
 
+#include "simd.h"
+#include "wide_bvh.h"
+
 #include <glm/glm.hpp>
 
 #include <bvh/v2/bvh.h>
 #include <bvh/v2/node.h>
 #include <bvh/v2/stack.h>
+#include <bvh/v2/thread_pool.h>
 #include <bvh/v2/tri.h>
 
+#include <algorithm>
+#include <array>
 #include <limits>
 #include <map>
 #include <memory>
 #include <optional>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include <cmath>
+#include <cstdint>
+
 struct Model final
 {
   using Vec3 = bvh::v2::Vec<float, 3>;
 
-  using Tri = bvh::v2::Tri<float, 3>;
+  using Tri = bvh::v2::PrecomputedTri<float>;
+
+  // The welded mesh. Triangles share the vertices at their corners, except across edges sharper than the
+  // crease angle (see Scene::setCreaseAngle), where each side keeps its own vertex and normal.
+  std::vector<Vec3> positions;
+
+  // The smooth normal of each vertex, octahedral encoded as two 16 bit values (see packNormal).
+  std::vector<std::uint32_t> normals;
 
-  std::vector<Tri> primitives;
+  // The triangles are stored in the order of the leaves of the BVH, and the vertices in the order the triangles
+  // first use them, so that the triangles of a leaf and their vertices are close together in memory.
+  std::vector<std::array<std::uint32_t, 3>> indices;
 
-  std::vector<Vec3> normals;
+  // The bottom level BVH, built once on load and shared by every instance of the model. Its leaves are ranges
+  // of triangles.
+  WideBvh bvh;
 
   Vec3 albedo;
 
   Vec3 emission;
 
   Vec3 segmentation;
+
+  std::size_t triangleCount() const { return indices.size(); }
+
+  bvh::v2::Tri<float, 3> triangle(const std::size_t i) const
+  {
+    const auto& index = indices[i];
+
+    return bvh::v2::Tri<float, 3>(positions[index[0]], positions[index[1]], positions[index[2]]);
+  }
+
+  // The normal interpolated at the barycentric coordinates that Tri::intersect returns, not normalized.
+  Vec3 normal(const std::size_t i, const float u, const float v) const
+  {
+    const auto& index = indices[i];
+
+    return unpackNormal(normals[index[0]]) * (1.0f - u - v) + unpackNormal(normals[index[1]]) * u +
+           unpackNormal(normals[index[2]]) * v;
+  }
+
+  static std::uint32_t packNormal(const Vec3& n);
+
+  static Vec3 unpackNormal(const std::uint32_t bits)
+  {
+    const auto x = static_cast<float>(static_cast<std::int16_t>(bits & 0xffff)) * (1.0f / 32767.0f);
+    const auto y = static_cast<float>(static_cast<std::int16_t>(bits >> 16)) * (1.0f / 32767.0f);
+    const auto z = 1.0f - std::abs(x) - std::abs(y);
+
+    // The lower hemisphere is folded over the diagonals of the octahedron.
+    const auto t = std::max(-z, 0.0f);
+
+    return Vec3((x >= 0.0f) ? (x - t) : (x + t), (y >= 0.0f) ? (y - t) : (y + t), z);
+  }
 };
 
 class Scene final
@@ -35,23 +89,29 @@ class Scene final
 public:
   using Vec3 = bvh::v2::Vec<float, 3>;
 
-  using Tri = bvh::v2::PrecomputedTri<float>;
-
   using Node = bvh::v2::Node<float, 3>;
 
   using Bvh = bvh::v2::Bvh<Node>;
 
   using Ray = bvh::v2::Ray<float, 3>;
 
-  struct Attributes final
+  explicit Scene(bvh::v2::ThreadPool& threadPool);
+
+  // Starts an empty scene that shares the models loaded by another one, so that several scenes
+  // (rendered from different threads) do not each keep a copy of the meshes and their BVHs.
+  Scene(bvh::v2::ThreadPool& threadPool, const Scene& models);
+
+  struct Instance final
   {
-    Vec3 normal;
+    std::size_t model;
 
-    Vec3 albedo;
+    glm::mat4 transform;
 
-    Vec3 emission;
+    glm::mat4 inverseTransform;
 
-    Vec3 segmentation;
+    glm::mat3 normalTransform;
+
+    Vec3 albedo;
 
     bool objectMask;
   };
@@ -60,6 +120,9 @@ public:
   {
     Vec3 normal;
 
+    // The unit normal of the triangle itself, which light sampling uses, on the side of its winding.
+    Vec3 faceNormal;
+
     Vec3 albedo;
 
     Vec3 emission;
@@ -67,88 +130,406 @@ public:
     Vec3 segmentation;
 
     bool objectMask;
+
+    std::uint32_t instance;
   };
 
+  // Where a ray hit, without any of the surface's attributes. The distance is the ray's shortened tmax.
+  struct Intersection final
+  {
+    std::uint32_t instance;
+
+    std::uint32_t primitive;
+
+    // The barycentric coordinates of the hit point.
+    float u;
+
+    float v;
+  };
+
+  // A point picked on the surface of an emissive instance.
+  struct LightSample final
+  {
+    Vec3 position;
+
+    Vec3 normal;
+
+    Vec3 emission;
+
+    // The probability density of picking this point, per unit area.
+    float pdfArea;
+  };
+
+  static constexpr int packetSize{ simd::width };
+
+  // A structure-of-arrays bundle of rays, traced together through the BVHs.
+  // Lanes with tmin > tmax are inactive.
+  struct RayPacket final
+  {
+    alignas(32) float org[3][packetSize];
+
+    alignas(32) float dir[3][packetSize];
+
+    alignas(32) float tmin[packetSize];
+
+    alignas(32) float tmax[packetSize];
+
+    void setRay(const int lane, const Ray& ray)
+    {
+      for (int i = 0; i < 3; i++) {
+        org[i][lane] = ray.org[i];
+        dir[i][lane] = ray.dir[i];
+      }
+      tmin[lane] = ray.tmin;
+      tmax[lane] = ray.tmax;
+    }
+
+    void disable(const int lane) { setRay(lane, Ray(Vec3(0, 0, 0), Vec3(0, 0, 1), 1.0f, 0.0f)); }
+
+    Ray getRay(const int lane) const
+    {
+      return Ray(Vec3(org[0][lane], org[1][lane], org[2][lane]),
+                 Vec3(dir[0][lane], dir[1][lane], dir[2][lane]),
+                 tmin[lane],
+                 tmax[lane]);
+    }
+  };
+
+  using PacketHits = std::array<std::optional<Hit>, packetSize>;
+
+  // Loads a binary STL file. The file is mapped rather than read, and large meshes are decoded in parallel.
   bool loadModel(const char* path, const Vec3& albedo, const Vec3& emission, const Vec3& segmentation);
 
+  // Where loadModel keeps the decoded triangles and the BVH of each model, named after a hash of the file's
+  // contents, so that later runs load them instead of decoding and building again. Empty disables the cache.
+  void setCacheDirectory(std::string path) { m_cacheDirectory = std::move(path); }
+
+  // Faces meeting at a vertex are shaded smoothly when their normals are less than this many degrees apart.
+  // Zero keeps every face flat. Applies to the models loaded afterwards.
+  void setCreaseAngle(const float degrees) { m_creaseAngle = degrees; }
+
   void instanceRange(std::size_t offset,
                      std::size_t count,
                      const glm::mat4& transform = glm::mat4(1.0f),
                      const std::optional<Vec3>& albedoOverride = std::nullopt,
                      bool objectMask = false);
 
-  void instanceSingle(std::size_t index,
-                      const glm::mat4& transform,
-                      const std::optional<Vec3>& albedoOverride,
-                      bool objectMask)
+  std::size_t instanceSingle(std::size_t index,
+                             const glm::mat4& transform,
+                             const std::optional<Vec3>& albedoOverride,
+                             bool objectMask)
   {
     instanceRange(index, 1, transform, albedoOverride, objectMask);
+
+    return m_instances.size() - 1;
   }
 
-  void randomize(int instance_count, int seed);
+  void setInstanceTransform(std::size_t instance, const glm::mat4& transform);
+
+  // Where randomize places its instances.
+  struct Placement final
+  {
+    // The models are picked at random from [modelOffset, modelOffset + modelCount).
+    std::size_t modelOffset;
+
+    std::size_t modelCount;
 
-  void commit();
+    // The box the origins of the instances are placed in. Each instance is also turned about the vertical axis.
+    Vec3 min;
+
+    Vec3 max;
+
+    // The least distance between the origins of any two object instances.
+    float spacing;
+  };
+
+  // Adds up to 'count' object instances at random, fewer if no free spot is found. Returns their indices.
+  std::vector<std::size_t> randomize(const Placement& placement, int count, int seed);
+
+  // The builders commit may use, from the fastest to the one giving the fastest traversal.
+  enum class Quality
+  {
+    Low,
+    Medium,
+    High
+  };
+
+  // Brings the top level BVH up to date with the instances. If instances were only moved since the last
+  // commit, the tree is refit to their new bounds instead, unless that makes it much slower to traverse than
+  // a new one, so that moving an object every frame costs next to nothing.
+  void commit(Quality quality = Quality::High);
 
   void clear()
   {
-    m_primitives.clear();
+    m_instances.clear();
 
-    m_attributes.clear();
+    m_instancesChanged = true;
   }
 
-  std::size_t primitiveCount() const { return m_primitives.size(); }
+  std::size_t primitiveCount() const
+  {
+    std::size_t count{ 0 };
 
-  std::optional<Hit> intersect(Ray& ray) const
+    for (const auto& instance : m_instances)
+      count += m_models[instance.model]->triangleCount();
+
+    return count;
+  }
+
+  // Finds the closest hit along the ray and shortens the ray to it. The attributes of the surface are left to
+  // hit() or normal(), for callers that need only some of them, or none.
+  std::optional<Intersection> intersectClosest(Ray& ray) const
   {
+    if (m_bvh.nodes.empty())
+      return std::nullopt;
+
     constexpr std::size_t stack_size{ 64 };
 
     bvh::v2::SmallStack<Bvh::Index, stack_size> stack;
 
     constexpr auto use_robust_traversal{ false };
 
-    constexpr auto invalid_id = std::numeric_limits<std::size_t>::max();
-
-    auto primitive_id = invalid_id;
+    std::optional<Intersection> closest;
 
     m_bvh.intersect<false, use_robust_traversal>(
       ray, m_bvh.get_root().index, stack, [&](const std::size_t begin, const std::size_t end) {
         auto hit_flag{ false };
         for (std::size_t i = begin; i < end; i++) {
-          const std::size_t j = m_bvh.prim_ids[i];
-          if (auto hit = m_primitives[j].intersect(ray)) {
-            primitive_id = j;
+          const auto& instance = m_traversal[i];
+          std::pair<float, float> uv;
+          const auto k = intersectInstance<false>(instance, ray, uv);
+          if (k != invalid_primitive) {
+            closest = Intersection{ instance.instance, static_cast<std::uint32_t>(k), uv.first, uv.second };
             hit_flag = true;
           }
         }
         return hit_flag;
       });
 
-    if (primitive_id == invalid_id)
+    return closest;
+  }
+
+  std::optional<Hit> intersect(Ray& ray) const
+  {
+    const auto closest = intersectClosest(ray);
+
+    if (!closest)
       return std::nullopt;
 
-    const auto& attrib = m_attributes[primitive_id];
+    return hit(*closest, ray.dir);
+  }
+
+  // Whether anything lies along the ray between tmin and tmax. Stops at the first hit found, which need not be
+  // the closest, so it is the cheaper query for shadow rays.
+  bool occluded(const Ray& ray) const
+  {
+    if (m_bvh.nodes.empty())
+      return false;
+
+    constexpr std::size_t stack_size{ 64 };
+
+    bvh::v2::SmallStack<Bvh::Index, stack_size> stack;
+
+    constexpr auto use_robust_traversal{ false };
+
+    auto shadow_ray = ray;
+
+    auto occluded{ false };
+
+    m_bvh.intersect<true, use_robust_traversal>(
+      shadow_ray, m_bvh.get_root().index, stack, [&](const std::size_t begin, const std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+          std::pair<float, float> uv;
+          if (intersectInstance<true>(m_traversal[i], shadow_ray, uv) != invalid_primitive) {
+            occluded = true;
+            return true;
+          }
+        }
+        return false;
+      });
+
+    return occluded;
+  }
+
+  // The attributes of the surface at an intersection, seen by a ray going in the direction 'dir'.
+  Hit hit(const Intersection& intersection, const Vec3& dir) const
+  {
+    const auto& instance = m_instances[intersection.instance];
+
+    const auto& model = *m_models[instance.model];
+
+    return Hit{ normal(intersection, dir),
+                faceNormal(intersection),
+                instance.albedo,
+                model.emission,
+                model.segmentation,
+                instance.objectMask,
+                intersection.instance };
+  }
+
+  // The shading normal at an intersection, turned towards the side the ray came from.
+  Vec3 normal(const Intersection& intersection, const Vec3& dir) const
+  {
+    const auto& instance = m_instances[intersection.instance];
+
+    const auto& model = *m_models[instance.model];
+
+    const auto face = faceNormal(intersection);
+
+    const auto smooth = model.normal(intersection.primitive, intersection.u, intersection.v);
+
+    const auto world_face = glm::vec3(face[0], face[1], face[2]);
+
+    const auto world_smooth = glm::normalize(instance.normalTransform * glm::vec3(smooth[0], smooth[1], smooth[2]));
+
+    // Surfaces are two sided.
 
-    // flip normal if needed. don't feel like checking the model normals
+    const auto facing = glm::dot(glm::vec3(dir[0], dir[1], dir[2]), world_face) < 0.0f;
 
-    auto normal = (dot(ray.dir, attrib.normal) < 0.0f) ? attrib.normal : -attrib.normal;
+    const auto flip = facing != (glm::dot(world_smooth, world_face) >= 0.0f);
 
-    return Hit{ normal, attrib.albedo, attrib.emission, attrib.segmentation, attrib.objectMask };
+    return flip ? -Vec3(world_smooth.x, world_smooth.y, world_smooth.z)
+                : Vec3(world_smooth.x, world_smooth.y, world_smooth.z);
   }
 
+  // The world space unit normal of the triangle at an intersection, on the side of its winding.
+  Vec3 faceNormal(const Intersection& intersection) const
+  {
+    const auto& instance = m_instances[intersection.instance];
+
+    const auto tri = m_models[instance.model]->triangle(intersection.primitive);
+
+    const auto face = cross(tri.p1 - tri.p0, tri.p2 - tri.p0);
+
+    const auto world_face = glm::normalize(instance.normalTransform * glm::vec3(face[0], face[1], face[2]));
+
+    return Vec3(world_face.x, world_face.y, world_face.z);
+  }
+
+  // Traces a packet of rays at once. Best suited to coherent rays, such as the primary rays of a pixel.
+  void intersect(RayPacket& packet, PacketHits& hits) const;
+
   std::size_t modelCount() const { return m_models.size(); }
 
+  const Model& model(const std::size_t index) const { return *m_models[index]; }
+
+  const std::vector<Instance>& instances() const { return m_instances; }
+
+  bool hasLights() const { return !m_lights.empty(); }
+
+  // Picks a point on an emissive triangle, with a probability proportional to its emitted power.
+  // Requires hasLights() to be true.
+  LightSample sampleLight(float u0, float u1, float u2) const;
+
+  // The solid angle density with which sampleLight picks a point at 'distance' along 'dir', on a light with the
+  // given emission and geometric normal. Light sampling and hits on emitters both use it, so that their MIS
+  // weights add up to one.
+  float lightPdf(const Vec3& emission, const Vec3& faceNormal, const Vec3& dir, float distance) const;
+
 protected:
-  void instance(const Model& model,
+  // The part of an instance that traversal reads, kept apart from the rest and in the order of the leaves of the
+  // top level BVH, so that a leaf reads consecutive records without going through its prim_ids.
+  struct TraversalInstance final
+  {
+    glm::mat4 inverseTransform;
+
+    const Model* model;
+
+    std::uint32_t instance;
+  };
+
+  void gatherLights();
+
+  void gatherTraversalInstances();
+
+  void instance(std::size_t model,
                 const glm::mat4& transform,
                 const std::optional<Vec3>& albedoOverride,
                 bool objectMask);
 
+  static constexpr std::size_t invalid_primitive{ std::numeric_limits<std::size_t>::max() };
+
+  // Traces the ray through the model's bottom level BVH in object space. Returns the primitive index on a hit
+  // (shortening the ray and setting its barycentric coordinates) or invalid_primitive on a miss. With IsAnyHit,
+  // the first hit found is returned.
+  template<bool IsAnyHit>
+  static std::size_t intersectInstance(const TraversalInstance& instance, Ray& ray, std::pair<float, float>& uv)
+  {
+    const auto& model = *instance.model;
+
+    const auto& inv = instance.inverseTransform;
+
+    const auto org = inv * glm::vec4(ray.org[0], ray.org[1], ray.org[2], 1.0f);
+
+    const auto dir = inv * glm::vec4(ray.dir[0], ray.dir[1], ray.dir[2], 0.0f);
+
+    // The direction is not renormalized, so distances along the ray are the same in both spaces.
+
+    Ray local_ray(Vec3(org.x, org.y, org.z), Vec3(dir.x, dir.y, dir.z), ray.tmin, ray.tmax);
+
+    auto primitive_id = invalid_primitive;
+
+    model.bvh.intersect<IsAnyHit>(local_ray, [&](const std::size_t begin, const std::size_t end) {
+      auto hit_flag{ false };
+      for (std::size_t j = begin; j < end; j++) {
+        if (auto hit = Model::Tri(model.triangle(j)).intersect(local_ray)) {
+          primitive_id = j;
+          uv = *hit;
+          hit_flag = true;
+          if (IsAnyHit)
+            break;
+        }
+      }
+      return hit_flag;
+    });
+
+    ray.tmax = local_ray.tmax;
+
+    return primitive_id;
+  }
+
 private:
-  std::vector<Tri> m_primitives;
+  bvh::v2::ThreadPool& m_threadPool;
 
-  std::vector<Attributes> m_attributes;
+  std::vector<Instance> m_instances;
 
+  // The top level BVH over the world space bounds of each instance.
   Bvh m_bvh;
 
-  std::vector<Model> m_models;
+  std::vector<TraversalInstance> m_traversal;
+
+  // The SAH cost of m_bvh when it was built, which refits are compared against.
+  float m_bvhCost{ 0.0f };
+
+  // Whether instances were added or removed since the last commit, which rules out a refit.
+  bool m_instancesChanged{ true };
+
+  // Whether an emissive instance was added, removed or moved since the last commit.
+  bool m_lightsChanged{ true };
+
+  struct Light final
+  {
+    Vec3 p0;
+
+    Vec3 p1;
+
+    Vec3 p2;
+
+    Vec3 normal;
+
+    Vec3 emission;
+  };
+
+  // The world space emissive triangles, gathered on commit.
+  std::vector<Light> m_lights;
+
+  // The running sum of the emitted power of each light, used to pick one.
+  std::vector<float> m_lightCdf;
+
+  // Models are immutable once loaded, so scenes can share them.
+  std::vector<std::shared_ptr<const Model>> m_models;
+
+  std::string m_cacheDirectory;
+
+  float m_creaseAngle{ 30.0f };
 };
@@ -0,0 +1,288 @@
+#include "shard.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include <cstring>
+
+namespace shard {
+
+namespace {
+
+Entry
+makeEntry(const char* name, const Format format, const int w, const int h, const int channels)
+{
+  Entry entry{};
+
+  std::strncpy(entry.name, name, sizeof(entry.name) - 1);
+
+  entry.format = format;
+  entry.width = static_cast<std::uint32_t>(w);
+  entry.height = static_cast<std::uint32_t>(h);
+  entry.channels = static_cast<std::uint32_t>(channels);
+
+  return entry;
+}
+
+// The payload size the dimensions of an entry call for, or false if its format is unknown or the size overflows.
+bool
+payloadSize(const Entry& entry, std::uint64_t& size)
+{
+  std::uint64_t element_size{ 0 };
+
+  switch (entry.format) {
+    case Format::Float32:
+    case Format::UInt32:
+      element_size = 4;
+      break;
+    case Format::UInt8:
+      element_size = 1;
+      break;
+    default:
+      return false;
+  }
+
+  // Each factor fits in 32 bits, so the first product can not overflow.
+
+  const auto pixels = static_cast<std::uint64_t>(entry.width) * entry.height;
+
+  constexpr auto limit = std::numeric_limits<std::uint64_t>::max();
+
+  if ((entry.channels != 0) && (pixels > (limit / entry.channels / element_size)))
+    return false;
+
+  size = pixels * entry.channels * element_size;
+
+  return true;
+}
+
+} // namespace
+
+void
+Writer::Frame::add(const char* name, const Image<bvh::v2::Vec<float, 3>>& image)
+{
+  const auto plane_size = sizeof(float) * static_cast<std::size_t>(image.width()) * image.height();
+
+  Pending pending{ makeEntry(name, Format::Float32, image.width(), image.height(), 3), {}, {} };
+
+  for (int c = 0; c < 3; c++)
+    pending.parts.emplace_back(image.plane(c), plane_size);
+
+  m_pending.emplace_back(std::move(pending));
+}
+
+void
+Writer::Frame::add(const char* name, const Image<float>& image)
+{
+  const auto size = sizeof(float) * static_cast<std::size_t>(image.width()) * image.height();
+
+  auto entry = makeEntry(name, Format::Float32, image.width(), image.height(), 1);
+
+  m_pending.emplace_back(Pending{ entry, { { image.data(), size } }, {} });
+}
+
+void
+Writer::Frame::add(const char* name, const Image<unsigned char>& image)
+{
+  const auto size = static_cast<std::size_t>(image.width()) * image.height();
+
+  auto entry = makeEntry(name, Format::UInt8, image.width(), image.height(), 1);
+
+  m_pending.emplace_back(Pending{ entry, { { image.data(), size } }, {} });
+}
+
+void
+Writer::Frame::add(const char* name, const Image<std::uint32_t>& image)
+{
+  const auto size = sizeof(std::uint32_t) * static_cast<std::size_t>(image.width()) * image.height();
+
+  auto entry = makeEntry(name, Format::UInt32, image.width(), image.height(), 1);
+
+  m_pending.emplace_back(Pending{ entry, { { image.data(), size } }, {} });
+}
+
+void
+Writer::Frame::add(const char* name, const std::string& text)
+{
+  auto entry = makeEntry(name, Format::UInt8, static_cast<int>(text.size()), 1, 1);
+
+  m_pending.emplace_back(Pending{ entry, {}, text });
+}
+
+Writer::Writer(std::string prefix, const std::size_t framesPerShard)
+  : m_prefix(std::move(prefix))
+  , m_framesPerShard(std::max<std::size_t>(framesPerShard, 1))
+{
+}
+
+Writer::~Writer()
+{
+  close();
+}
+
+void
+Writer::write(const std::uint32_t frameIndex, const Frame& frame)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  if (!m_file.is_open())
+    open();
+
+  const char zeros[alignment]{};
+
+  for (const auto& pending : frame.m_pending) {
+
+    auto entry = pending.entry;
+
+    entry.frame = frameIndex;
+
+    const auto padding = (alignment - (m_offset % alignment)) % alignment;
+
+    m_file.write(zeros, static_cast<std::streamsize>(padding));
+
+    m_offset += padding;
+
+    entry.offset = m_offset;
+
+    entry.size = 0;
+
+    for (const auto& [data, size] : pending.parts) {
+      m_file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+      entry.size += size;
+    }
+
+    m_file.write(pending.text.data(), static_cast<std::streamsize>(pending.text.size()));
+
+    entry.size += pending.text.size();
+
+    m_offset += entry.size;
+
+    m_index.emplace_back(entry);
+  }
+
+  m_frameCount++;
+
+  if (m_frameCount >= m_framesPerShard)
+    close();
+}
+
+bool
+Writer::flush()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  close();
+
+  return !m_failed;
+}
+
+void
+Writer::open()
+{
+  std::ostringstream path;
+
+  path << m_prefix << '_' << std::setw(5) << std::setfill('0') << m_shardIndex << ".shard";
+
+  m_file.open(path.str(), std::ios::binary | std::ios::trunc);
+
+  if (!m_file)
+    throw std::runtime_error("Failed to open '" + path.str() + "' for writing.");
+
+  // The header is written again once the index is known.
+
+  const Header header{};
+
+  m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  m_offset = sizeof(header);
+
+  m_frameCount = 0;
+
+  m_index.clear();
+}
+
+void
+Writer::close()
+{
+  if (!m_file.is_open())
+    return;
+
+  Header header{};
+
+  std::memcpy(header.magic, magic, sizeof(magic));
+
+  header.version = version;
+
+  header.entryCount = static_cast<std::uint32_t>(m_index.size());
+
+  header.indexOffset = m_offset;
+
+  const auto index_size = static_cast<std::streamsize>(m_index.size() * sizeof(Entry));
+
+  m_file.write(reinterpret_cast<const char*>(m_index.data()), index_size);
+
+  m_file.seekp(0);
+
+  m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  m_file.close();
+
+  // The stream's error state is sticky, so this catches any failed write to the shard.
+  if (m_file.fail())
+    m_failed = true;
+
+  m_shardIndex++;
+}
+
+Reader::Reader(const std::string& path)
+  : m_file(path)
+{
+  if (!m_file)
+    throw std::runtime_error("Failed to open '" + path + "'.");
+
+  const auto* data = m_file.data();
+
+  const auto size = m_file.size();
+
+  Header header{};
+
+  if (size >= sizeof(header))
+    std::memcpy(&header, data, sizeof(header));
+
+  const auto index_size = static_cast<std::uint64_t>(header.entryCount) * sizeof(Entry);
+
+  if ((std::memcmp(header.magic, magic, sizeof(magic)) != 0) || (header.version != version) ||
+      (header.indexOffset > size) || (index_size > (size - header.indexOffset)))
+    throw std::runtime_error("'" + path + "' is not a valid shard.");
+
+  m_entries.resize(header.entryCount);
+
+  std::memcpy(m_entries.data(), data + header.indexOffset, index_size);
+
+  for (const auto& entry : m_entries) {
+
+    if ((entry.offset > header.indexOffset) || (entry.size > (header.indexOffset - entry.offset)))
+      throw std::runtime_error("'" + path + "' has an entry outside of its payload.");
+
+    std::uint64_t expected_size{ 0 };
+
+    if (!payloadSize(entry, expected_size) || (entry.size != expected_size))
+      throw std::runtime_error("'" + path + "' has an entry whose size does not match its dimensions.");
+  }
+}
+
+const Entry*
+Reader::find(const std::uint32_t frame, const char* name) const
+{
+  for (const auto& entry : m_entries) {
+    if ((entry.frame == frame) && (std::strncmp(entry.name, name, sizeof(entry.name)) == 0))
+      return &entry;
+  }
+
+  return nullptr;
+}
+
+} // namespace shard
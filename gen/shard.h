@@ -0,0 +1,183 @@
+#pragma once
+
+#include "image.h"
+#include "mapped_file.h"
+
+#include <bvh/v2/vec.h>
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+// A container for many frames worth of images, so that a dataset is a handful of large files
+// instead of tens of thousands of small ones.
+//
+// A shard starts with a fixed size header, followed by the raw entry payloads (each starting on
+// a 64 byte boundary) and ends with an index of every entry. Images are stored uncompressed as
+// planes, one channel after the other, so a reader can map the file and use them in place.
+namespace shard {
+
+constexpr char magic[8]{ 'G', 'E', 'N', 'S', 'H', 'R', 'D', '1' };
+
+constexpr std::uint32_t version{ 1 };
+
+constexpr std::size_t alignment{ 64 };
+
+enum class Format : std::uint32_t
+{
+  // 32 bit floats.
+  Float32,
+  // Bytes, also used for text such as annotations (with a height and channel count of one).
+  UInt8,
+  // 32 bit unsigned integers, such as instance IDs.
+  UInt32
+};
+
+struct Header final
+{
+  char magic[8];
+
+  std::uint32_t version;
+
+  std::uint32_t entryCount;
+
+  // Where the index starts, from the beginning of the file.
+  std::uint64_t indexOffset;
+};
+
+struct Entry final
+{
+  std::uint32_t frame;
+
+  // Null terminated.
+  char name[28];
+
+  Format format;
+
+  std::uint32_t width;
+
+  std::uint32_t height;
+
+  std::uint32_t channels;
+
+  std::uint64_t offset;
+
+  std::uint64_t size;
+};
+
+static_assert(sizeof(Header) == 24);
+
+static_assert(sizeof(Entry) == 64);
+
+// Appends frames to numbered shard files ('<prefix>_00000.shard', ...), starting a new file once
+// the current one holds the given number of frames. Safe to use from several threads.
+class Writer final
+{
+public:
+  Writer(std::string prefix, std::size_t framesPerShard = 256);
+
+  Writer(const Writer&) = delete;
+
+  Writer& operator=(const Writer&) = delete;
+
+  // Writes the index of the last shard.
+  ~Writer();
+
+  // Adds the entries of one frame. The frame is written as a whole, so frames never interleave.
+  class Frame final
+  {
+  public:
+    void add(const char* name, const Image<bvh::v2::Vec<float, 3>>& image);
+
+    void add(const char* name, const Image<float>& image);
+
+    void add(const char* name, const Image<unsigned char>& image);
+
+    void add(const char* name, const Image<std::uint32_t>& image);
+
+    void add(const char* name, const std::string& text);
+
+  private:
+    friend Writer;
+
+    struct Pending final
+    {
+      Entry entry;
+
+      // The planes of an image entry, written in place.
+      std::vector<std::pair<const void*, std::size_t>> parts;
+
+      // The payload of a text entry, copied since the caller's strings may be temporaries.
+      std::string text;
+    };
+
+    std::vector<Pending> m_pending;
+  };
+
+  // Throws if a new shard can not be opened.
+  void write(std::uint32_t frameIndex, const Frame& frame);
+
+  // Finishes the current shard, so that it can be read while the writer is still alive. Returns whether every
+  // shard closed so far was written completely.
+  bool flush();
+
+private:
+  void open();
+
+  void close();
+
+  std::mutex m_mutex;
+
+  std::string m_prefix;
+
+  std::size_t m_framesPerShard;
+
+  std::size_t m_shardIndex{ 0 };
+
+  std::size_t m_frameCount{ 0 };
+
+  bool m_failed{ false };
+
+  std::ofstream m_file;
+
+  std::uint64_t m_offset{ 0 };
+
+  std::vector<Entry> m_index;
+};
+
+// Maps a shard into memory (or reads it, where mapping is not available) and gives access to its entries.
+class Reader final
+{
+public:
+  // Throws std::runtime_error if the file cannot be opened or is not a valid shard.
+  explicit Reader(const std::string& path);
+
+  Reader(const Reader&) = delete;
+
+  Reader& operator=(const Reader&) = delete;
+
+  const std::vector<Entry>& entries() const { return m_entries; }
+
+  // Returns the entry of the given frame and name, or null if there is none.
+  const Entry* find(std::uint32_t frame, const char* name) const;
+
+  // The payload of an entry, valid for as long as the reader is.
+  const void* data(const Entry& entry) const { return m_file.data() + entry.offset; }
+
+  // Plane 'c' of a float image entry. The reader only accepts entries whose size matches their dimensions.
+  const float* plane(const Entry& entry, std::uint32_t c) const
+  {
+    return static_cast<const float*>(data(entry)) + static_cast<std::size_t>(entry.width) * entry.height * c;
+  }
+
+private:
+  MappedFile m_file;
+
+  std::vector<Entry> m_entries;
+};
+
+} // namespace shard
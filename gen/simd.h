@@ -0,0 +1,392 @@
+#pragma once
+
+// A minimal set of wide float operations used by the packet traversal code.
+//
+// The instruction set is picked at build time with the GEN_SIMD cache variable,
+// which defines GEN_SIMD_AVX2 or GEN_SIMD_SSE. Without either (or on a target
+// that lacks the instructions), a plain array implementation is used instead.
+
+#if defined(GEN_SIMD_AVX2) && defined(__AVX2__)
+#include <immintrin.h>
+#define GEN_SIMD_WIDTH 8
+#elif defined(GEN_SIMD_SSE) && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define GEN_SIMD_WIDTH 4
+#else
+#define GEN_SIMD_SCALAR
+#define GEN_SIMD_WIDTH 4
+#endif
+
+namespace simd {
+
+constexpr int width{ GEN_SIMD_WIDTH };
+
+#if GEN_SIMD_WIDTH == 8
+
+struct Float final
+{
+  __m256 v;
+};
+
+struct Mask final
+{
+  __m256 v;
+};
+
+inline Float
+broadcast(const float x)
+{
+  return { _mm256_set1_ps(x) };
+}
+
+inline Float
+load(const float* p)
+{
+  return { _mm256_load_ps(p) };
+}
+
+inline void
+store(float* p, const Float& a)
+{
+  _mm256_store_ps(p, a.v);
+}
+
+inline Float
+operator+(const Float& a, const Float& b)
+{
+  return { _mm256_add_ps(a.v, b.v) };
+}
+
+inline Float
+operator-(const Float& a, const Float& b)
+{
+  return { _mm256_sub_ps(a.v, b.v) };
+}
+
+inline Float
+operator*(const Float& a, const Float& b)
+{
+  return { _mm256_mul_ps(a.v, b.v) };
+}
+
+inline Float
+operator/(const Float& a, const Float& b)
+{
+  return { _mm256_div_ps(a.v, b.v) };
+}
+
+inline Float
+min(const Float& a, const Float& b)
+{
+  return { _mm256_min_ps(a.v, b.v) };
+}
+
+inline Float
+max(const Float& a, const Float& b)
+{
+  return { _mm256_max_ps(a.v, b.v) };
+}
+
+inline Mask
+operator<(const Float& a, const Float& b)
+{
+  return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) };
+}
+
+inline Mask
+operator<=(const Float& a, const Float& b)
+{
+  return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) };
+}
+
+inline Mask
+operator>=(const Float& a, const Float& b)
+{
+  return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) };
+}
+
+inline Mask
+operator&(const Mask& a, const Mask& b)
+{
+  return { _mm256_and_ps(a.v, b.v) };
+}
+
+inline Mask
+operator|(const Mask& a, const Mask& b)
+{
+  return { _mm256_or_ps(a.v, b.v) };
+}
+
+// Returns a where the mask is set, otherwise b.
+inline Float
+select(const Mask& m, const Float& a, const Float& b)
+{
+  return { _mm256_blendv_ps(b.v, a.v, m.v) };
+}
+
+inline int
+bits(const Mask& m)
+{
+  return _mm256_movemask_ps(m.v);
+}
+
+#elif !defined(GEN_SIMD_SCALAR)
+
+struct Float final
+{
+  __m128 v;
+};
+
+struct Mask final
+{
+  __m128 v;
+};
+
+inline Float
+broadcast(const float x)
+{
+  return { _mm_set1_ps(x) };
+}
+
+inline Float
+load(const float* p)
+{
+  return { _mm_load_ps(p) };
+}
+
+inline void
+store(float* p, const Float& a)
+{
+  _mm_store_ps(p, a.v);
+}
+
+inline Float
+operator+(const Float& a, const Float& b)
+{
+  return { _mm_add_ps(a.v, b.v) };
+}
+
+inline Float
+operator-(const Float& a, const Float& b)
+{
+  return { _mm_sub_ps(a.v, b.v) };
+}
+
+inline Float
+operator*(const Float& a, const Float& b)
+{
+  return { _mm_mul_ps(a.v, b.v) };
+}
+
+inline Float
+operator/(const Float& a, const Float& b)
+{
+  return { _mm_div_ps(a.v, b.v) };
+}
+
+inline Float
+min(const Float& a, const Float& b)
+{
+  return { _mm_min_ps(a.v, b.v) };
+}
+
+inline Float
+max(const Float& a, const Float& b)
+{
+  return { _mm_max_ps(a.v, b.v) };
+}
+
+inline Mask
+operator<(const Float& a, const Float& b)
+{
+  return { _mm_cmplt_ps(a.v, b.v) };
+}
+
+inline Mask
+operator<=(const Float& a, const Float& b)
+{
+  return { _mm_cmple_ps(a.v, b.v) };
+}
+
+inline Mask
+operator>=(const Float& a, const Float& b)
+{
+  return { _mm_cmpge_ps(a.v, b.v) };
+}
+
+inline Mask
+operator&(const Mask& a, const Mask& b)
+{
+  return { _mm_and_ps(a.v, b.v) };
+}
+
+inline Mask
+operator|(const Mask& a, const Mask& b)
+{
+  return { _mm_or_ps(a.v, b.v) };
+}
+
+// Returns a where the mask is set, otherwise b.
+inline Float
+select(const Mask& m, const Float& a, const Float& b)
+{
+  return { _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)) };
+}
+
+inline int
+bits(const Mask& m)
+{
+  return _mm_movemask_ps(m.v);
+}
+
+#else
+
+struct Float final
+{
+  float v[width];
+};
+
+struct Mask final
+{
+  bool v[width];
+};
+
+template<typename Op>
+inline Float
+apply(const Float& a, const Float& b, Op op)
+{
+  Float result;
+  for (int i = 0; i < width; i++)
+    result.v[i] = op(a.v[i], b.v[i]);
+  return result;
+}
+
+template<typename Op>
+inline Mask
+compare(const Float& a, const Float& b, Op op)
+{
+  Mask result;
+  for (int i = 0; i < width; i++)
+    result.v[i] = op(a.v[i], b.v[i]);
+  return result;
+}
+
+inline Float
+broadcast(const float x)
+{
+  Float result;
+  for (int i = 0; i < width; i++)
+    result.v[i] = x;
+  return result;
+}
+
+inline Float
+load(const float* p)
+{
+  Float result;
+  for (int i = 0; i < width; i++)
+    result.v[i] = p[i];
+  return result;
+}
+
+inline void
+store(float* p, const Float& a)
+{
+  for (int i = 0; i < width; i++)
+    p[i] = a.v[i];
+}
+
+inline Float
+operator+(const Float& a, const Float& b)
+{
+  return apply(a, b, [](float x, float y) { return x + y; });
+}
+
+inline Float
+operator-(const Float& a, const Float& b)
+{
+  return apply(a, b, [](float x, float y) { return x - y; });
+}
+
+inline Float
+operator*(const Float& a, const Float& b)
+{
+  return apply(a, b, [](float x, float y) { return x * y; });
+}
+
+inline Float
+operator/(const Float& a, const Float& b)
+{
+  return apply(a, b, [](float x, float y) { return x / y; });
+}
+
+inline Float
+min(const Float& a, const Float& b)
+{
+  return apply(a, b, [](float x, float y) { return x < y ? x : y; });
+}
+
+inline Float
+max(const Float& a, const Float& b)
+{
+  return apply(a, b, [](float x, float y) { return x > y ? x : y; });
+}
+
+inline Mask
+operator<(const Float& a, const Float& b)
+{
+  return compare(a, b, [](float x, float y) { return x < y; });
+}
+
+inline Mask
+operator<=(const Float& a, const Float& b)
+{
+  return compare(a, b, [](float x, float y) { return x <= y; });
+}
+
+inline Mask
+operator>=(const Float& a, const Float& b)
+{
+  return compare(a, b, [](float x, float y) { return x >= y; });
+}
+
+inline Mask
+operator&(const Mask& a, const Mask& b)
+{
+  Mask result;
+  for (int i = 0; i < width; i++)
+    result.v[i] = a.v[i] && b.v[i];
+  return result;
+}
+
+inline Mask
+operator|(const Mask& a, const Mask& b)
+{
+  Mask result;
+  for (int i = 0; i < width; i++)
+    result.v[i] = a.v[i] || b.v[i];
+  return result;
+}
+
+// Returns a where the mask is set, otherwise b.
+inline Float
+select(const Mask& m, const Float& a, const Float& b)
+{
+  Float result;
+  for (int i = 0; i < width; i++)
+    result.v[i] = m.v[i] ? a.v[i] : b.v[i];
+  return result;
+}
+
+inline int
+bits(const Mask& m)
+{
+  int result{ 0 };
+  for (int i = 0; i < width; i++)
+    result |= m.v[i] ? (1 << i) : 0;
+  return result;
+}
+
+#endif
+
+} // namespace simd
@@ -0,0 +1,93 @@
+#include "tile_scheduler.h"
+
+#include <algorithm>
+
+namespace {
+
+std::uint32_t
+spreadBits(std::uint32_t x)
+{
+  x &= 0x0000ffff;
+  x = (x | (x << 8)) & 0x00ff00ff;
+  x = (x | (x << 4)) & 0x0f0f0f0f;
+  x = (x | (x << 2)) & 0x33333333;
+  x = (x | (x << 1)) & 0x55555555;
+  return x;
+}
+
+std::uint32_t
+mortonCode(const std::uint32_t x, const std::uint32_t y)
+{
+  return spreadBits(x) | (spreadBits(y) << 1);
+}
+
+} // namespace
+
+TileScheduler::TileScheduler(const int w, const int h, const int tileSize)
+{
+  const int xTiles = (w + tileSize - 1) / tileSize;
+  const int yTiles = (h + tileSize - 1) / tileSize;
+
+  std::vector<std::pair<std::uint32_t, Tile>> tiles;
+
+  for (int y = 0; y < yTiles; y++) {
+    for (int x = 0; x < xTiles; x++) {
+      const auto xMin = x * tileSize;
+      const auto yMin = y * tileSize;
+      tiles.emplace_back(mortonCode(x, y), Tile{ xMin, yMin, std::min(xMin + tileSize, w), std::min(yMin + tileSize, h) });
+    }
+  }
+
+  std::sort(tiles.begin(), tiles.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  for (const auto& t : tiles)
+    m_tiles.emplace_back(t.second);
+}
+
+bool
+TileScheduler::popFront(Range& range, std::size_t& index)
+{
+  auto bounds = range.bounds.load(std::memory_order_relaxed);
+
+  while (true) {
+    const auto begin = bounds & 0xffffffff;
+    const auto end = bounds >> 32;
+    if (begin >= end)
+      return false;
+    if (range.bounds.compare_exchange_weak(bounds, pack(begin + 1, end), std::memory_order_relaxed)) {
+      index = begin;
+      return true;
+    }
+  }
+}
+
+bool
+TileScheduler::popBack(Range& range, std::size_t& index)
+{
+  auto bounds = range.bounds.load(std::memory_order_relaxed);
+
+  while (true) {
+    const auto begin = bounds & 0xffffffff;
+    const auto end = bounds >> 32;
+    if (begin >= end)
+      return false;
+    if (range.bounds.compare_exchange_weak(bounds, pack(begin, end - 1), std::memory_order_relaxed)) {
+      index = end - 1;
+      return true;
+    }
+  }
+}
+
+bool
+TileScheduler::next(const std::size_t worker, const std::size_t workerCount, std::size_t& index)
+{
+  if (popFront(m_ranges[worker], index))
+    return true;
+
+  for (std::size_t i = 1; i < workerCount; i++) {
+    if (popBack(m_ranges[(worker + i) % workerCount], index))
+      return true;
+  }
+
+  return false;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <bvh/v2/thread_pool.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+// Splits an image into square tiles, ordered along a Morton curve so that neighboring
+// tiles (and the BVH nodes their rays touch) tend to be processed by the same worker.
+//
+// Each worker starts with a contiguous run of tiles. Once it runs out, it steals tiles
+// from the back of another worker's run, which keeps the load balanced when some tiles
+// (sky) are much cheaper than others (shelves, room).
+class TileScheduler final
+{
+public:
+  struct Tile final
+  {
+    int xMin;
+
+    int yMin;
+
+    int xMax;
+
+    int yMax;
+  };
+
+  TileScheduler(int w, int h, int tileSize = 16);
+
+  std::size_t tileCount() const { return m_tiles.size(); }
+
+  const Tile& tile(const std::size_t index) const { return m_tiles[index]; }
+
+  // Calls fn(tile) for every tile, from all the workers of the thread pool.
+  template<typename Fn>
+  void run(bvh::v2::ThreadPool& threadPool, Fn&& fn);
+
+private:
+  struct alignas(64) Range final
+  {
+    // The first tile in the lower 32 bits, one past the last tile in the upper 32 bits.
+    std::atomic<std::uint64_t> bounds{ 0 };
+  };
+
+  static std::uint64_t pack(std::uint64_t begin, std::uint64_t end) { return begin | (end << 32); }
+
+  static bool popFront(Range& range, std::size_t& index);
+
+  static bool popBack(Range& range, std::size_t& index);
+
+  bool next(std::size_t worker, std::size_t workerCount, std::size_t& index);
+
+  std::vector<Tile> m_tiles;
+
+  std::unique_ptr<Range[]> m_ranges;
+
+  std::size_t m_rangeCount{ 0 };
+};
+
+template<typename Fn>
+void
+TileScheduler::run(bvh::v2::ThreadPool& threadPool, Fn&& fn)
+{
+  const auto workerCount = std::max<std::size_t>(threadPool.get_thread_count(), 1);
+
+  if (m_rangeCount < workerCount) {
+    m_ranges.reset(new Range[workerCount]);
+    m_rangeCount = workerCount;
+  }
+
+  for (std::size_t i = 0; i < workerCount; i++) {
+    const auto begin = (m_tiles.size() * i) / workerCount;
+    const auto end = (m_tiles.size() * (i + 1)) / workerCount;
+    m_ranges[i].bounds.store(pack(begin, end), std::memory_order_relaxed);
+  }
+
+  for (std::size_t i = 0; i < workerCount; i++) {
+    threadPool.push([this, i, workerCount, &fn](std::size_t) {
+      std::size_t index{ 0 };
+      while (next(i, workerCount, index))
+        fn(m_tiles[index]);
+    });
+  }
+
+  threadPool.wait();
+}
@@ -0,0 +1,182 @@
+#include "wide_bvh.h"
+
+#include <stdexcept>
+
+#include <cmath>
+
+namespace {
+
+using BinaryBvh = WideBvh::BinaryBvh;
+
+using BBox = WideBvh::BBox;
+
+// The smallest power of two step that spans [lo, hi] in 255 steps, as its exponent.
+int
+quantizationExponent(const float lo, const float hi)
+{
+  constexpr int min_exponent{ -126 };
+
+  constexpr int max_exponent{ 127 };
+
+  const auto extent = hi - lo;
+
+  auto exponent = (extent > 0.0f) ? static_cast<int>(std::ceil(std::log2(extent / 255.0f))) : min_exponent;
+
+  exponent = std::clamp(exponent, min_exponent, max_exponent);
+
+  while ((exponent < max_exponent) && ((lo + 255.0f * std::ldexp(1.0f, exponent)) < hi))
+    exponent++;
+
+  return exponent;
+}
+
+class Collapser final
+{
+public:
+  Collapser(const BinaryBvh& binary, WideBvh& wide)
+    : m_binary(binary)
+    , m_wide(wide)
+  {
+  }
+
+  // Emits the wide node for a binary node and everything below it, and returns its index.
+  std::uint32_t emit(const std::size_t binary_index)
+  {
+    const auto slot = static_cast<std::uint32_t>(m_wide.nodes.size());
+
+    m_wide.nodes.emplace_back();
+
+    const auto& binary_node = m_binary.nodes[binary_index];
+
+    // Open the largest inner child until there are enough children, so that the big nodes near the root,
+    // which most rays visit, are the ones that lose a level.
+
+    std::vector<std::size_t> children;
+
+    if (binary_node.index.is_leaf()) {
+      children.emplace_back(binary_index);
+    } else {
+      children.emplace_back(binary_node.index.first_id());
+      children.emplace_back(binary_node.index.first_id() + 1);
+    }
+
+    while (children.size() < static_cast<std::size_t>(WideBvh::arity)) {
+
+      auto best = children.end();
+
+      auto best_area = -1.0f;
+
+      for (auto it = children.begin(); it != children.end(); ++it) {
+        const auto& child = m_binary.nodes[*it];
+        const auto area = child.get_bbox().get_half_area();
+        if (!child.index.is_leaf() && (area > best_area)) {
+          best = it;
+          best_area = area;
+        }
+      }
+
+      if (best == children.end())
+        break;
+
+      const auto first = m_binary.nodes[*best].index.first_id();
+
+      *best = first;
+
+      children.insert(best + 1, first + 1);
+    }
+
+    WideBvh::Node node{};
+
+    const auto bbox = binary_node.get_bbox();
+
+    int exponents[3];
+
+    for (int axis = 0; axis < 3; axis++) {
+      exponents[axis] = quantizationExponent(bbox.min[axis], bbox.max[axis]);
+      node.origin[axis] = bbox.min[axis];
+      node.exponent[axis] = static_cast<std::int8_t>(exponents[axis]);
+    }
+
+    node.childCount = static_cast<std::uint8_t>(children.size());
+
+    for (std::size_t i = 0; i < children.size(); i++) {
+
+      const auto& child = m_binary.nodes[children[i]];
+
+      const auto child_bbox = child.get_bbox();
+
+      for (int axis = 0; axis < 3; axis++)
+        quantize(node, axis, node.scale(axis), child_bbox.min[axis], child_bbox.max[axis], i);
+
+      if (child.index.is_leaf()) {
+        if (child.index.prim_count() > std::numeric_limits<std::uint8_t>::max())
+          throw std::runtime_error("BVH leaf too large to compress.");
+        node.child[i] = static_cast<std::uint32_t>(child.index.first_id());
+        node.primCount[i] = static_cast<std::uint8_t>(child.index.prim_count());
+      }
+    }
+
+    // The children are emitted after their parent, so a subtree is stored contiguously.
+
+    for (std::size_t i = 0; i < children.size(); i++) {
+      const auto& child = m_binary.nodes[children[i]];
+      if (!child.index.is_leaf())
+        node.child[i] = emit(children[i]);
+    }
+
+    m_wide.nodes[slot] = node;
+
+    return slot;
+  }
+
+private:
+  // Rounds outwards, checking against the same arithmetic as decoding, so the decoded bounds always enclose.
+  static void quantize(WideBvh::Node& node,
+                       const int axis,
+                       const float step,
+                       const float lo,
+                       const float hi,
+                       const std::size_t i)
+  {
+    const auto origin = node.origin[axis];
+
+    auto q_min = static_cast<int>(std::clamp(std::floor((lo - origin) / step), 0.0f, 255.0f));
+
+    while ((q_min > 0) && ((origin + static_cast<float>(q_min) * step) > lo))
+      q_min--;
+
+    auto q_max = static_cast<int>(std::clamp(std::ceil((hi - origin) / step), 0.0f, 255.0f));
+
+    while ((q_max < 255) && ((origin + static_cast<float>(q_max) * step) < hi))
+      q_max++;
+
+    node.qmin[axis][i] = static_cast<std::uint8_t>(q_min);
+
+    node.qmax[axis][i] = static_cast<std::uint8_t>(q_max);
+  }
+
+  const BinaryBvh& m_binary;
+
+  WideBvh& m_wide;
+};
+
+} // namespace
+
+WideBvh
+WideBvh::compress(const BinaryBvh& binary)
+{
+  WideBvh wide;
+
+  if (binary.nodes.empty())
+    return wide;
+
+  wide.nodes.reserve(binary.nodes.size() / 2 + 1);
+
+  Collapser(binary, wide).emit(0);
+
+  wide.nodes.shrink_to_fit();
+
+  wide.bounds = binary.get_root().get_bbox();
+
+  return wide;
+}
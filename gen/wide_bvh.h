@@ -0,0 +1,193 @@
+#pragma once
+
+#include <bvh/v2/bbox.h>
+#include <bvh/v2/bvh.h>
+#include <bvh/v2/node.h>
+#include <bvh/v2/ray.h>
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <vector>
+
+#include <cstdint>
+#include <cstring>
+
+// A BVH with up to four children per node, made by collapsing a binary one. Each node holds the bounds of its
+// children quantized to 8 bits within its own box, so that a node and all of its children fit in one cache line,
+// where a binary node needs two half lines per pair of children.
+//
+// The leaves refer to ranges of primitives directly: the primitives must be stored in the order of the binary
+// BVH's prim_ids, which removes an indirection from every leaf test.
+class WideBvh final
+{
+public:
+  using Vec3 = bvh::v2::Vec<float, 3>;
+
+  using BBox = bvh::v2::BBox<float, 3>;
+
+  using Ray = bvh::v2::Ray<float, 3>;
+
+  using BinaryBvh = bvh::v2::Bvh<bvh::v2::Node<float, 3>>;
+
+  static constexpr int arity{ 4 };
+
+  struct alignas(64) Node final
+  {
+    float origin[3];
+
+    // The quantization step of each axis is 2^exponent, so that decoding is exact.
+    std::int8_t exponent[3];
+
+    std::uint8_t childCount;
+
+    // Per axis, then per child.
+    std::uint8_t qmin[3][arity];
+
+    std::uint8_t qmax[3][arity];
+
+    // The node index of an inner child, or the first primitive of a leaf child.
+    std::uint32_t child[arity];
+
+    // Zero for inner children.
+    std::uint8_t primCount[arity];
+
+    // The bounds of a child, which enclose its exact bounds.
+    BBox childBounds(const int i) const
+    {
+      BBox bbox;
+
+      for (int axis = 0; axis < 3; axis++) {
+        const auto step = scale(axis);
+        bbox.min[axis] = origin[axis] + static_cast<float>(qmin[axis][i]) * step;
+        bbox.max[axis] = origin[axis] + static_cast<float>(qmax[axis][i]) * step;
+      }
+
+      return bbox;
+    }
+
+    float scale(const int axis) const
+    {
+      const auto bits = static_cast<std::uint32_t>(exponent[axis] + 127) << 23;
+      float value;
+      std::memcpy(&value, &bits, sizeof(value));
+      return value;
+    }
+  };
+
+  static_assert(sizeof(Node) == 64);
+
+  static WideBvh compress(const BinaryBvh& binary);
+
+  bool empty() const { return nodes.empty(); }
+
+  // Calls leaf_fn(begin, end) with the primitives of every leaf the ray enters, nearest child first. The leaf
+  // function returns whether it hit something, and shortens ray.tmax when it does. With IsAnyHit, traversal
+  // stops at the first hit.
+  template<bool IsAnyHit, typename LeafFn>
+  void intersect(const Ray& ray, LeafFn&& leaf_fn) const;
+
+  std::vector<Node> nodes;
+
+  BBox bounds{ BBox::make_empty() };
+};
+
+template<bool IsAnyHit, typename LeafFn>
+void
+WideBvh::intersect(const Ray& ray, LeafFn&& leaf_fn) const
+{
+  if (nodes.empty())
+    return;
+
+  const auto inv_dir = ray.get_inv_dir();
+
+  // A node or leaf to visit, and the distance at which the ray enters it, so that entries the ray has since been
+  // shortened past are skipped.
+  struct Entry final
+  {
+    std::uint32_t index;
+
+    std::uint32_t primCount;
+
+    float distance;
+  };
+
+  // Each node pushes at most three more entries than it pops, so this covers trees far deeper than the builder
+  // makes. A damaged tree that is deeper loses its farthest children instead of overrunning the stack.
+  constexpr std::size_t stack_size{ 256 };
+
+  std::array<Entry, stack_size> stack;
+
+  std::size_t stack_top{ 0 };
+
+  stack[stack_top++] = Entry{ 0, 0, ray.tmin };
+
+  while (stack_top > 0) {
+
+    auto entry = stack[--stack_top];
+
+    if (entry.distance > ray.tmax)
+      continue;
+
+    // Descend into the nearest child without going through the stack, until a leaf or a miss.
+
+    while (entry.primCount == 0) {
+
+      const auto& node = nodes[entry.index];
+
+      // The slabs of child i along an axis are at origin + q * step, so their distances along the ray are
+      // base + q * step / dir, with the base and the scaled step shared by all the children.
+
+      float base[3];
+
+      float step[3];
+
+      for (int axis = 0; axis < 3; axis++) {
+        base[axis] = (node.origin[axis] - ray.org[axis]) * inv_dir[axis];
+        step[axis] = node.scale(axis) * inv_dir[axis];
+      }
+
+      // The children the ray enters, sorted from the farthest to the nearest, which is the order they are pushed in.
+
+      Entry hits[arity];
+
+      int hit_count{ 0 };
+
+      for (int i = 0; i < node.childCount; i++) {
+
+        auto t_near = ray.tmin;
+        auto t_far = ray.tmax;
+
+        for (int axis = 0; axis < 3; axis++) {
+          const auto t0 = base[axis] + static_cast<float>(node.qmin[axis][i]) * step[axis];
+          const auto t1 = base[axis] + static_cast<float>(node.qmax[axis][i]) * step[axis];
+          t_near = std::max(t_near, std::min(t0, t1));
+          t_far = std::min(t_far, std::max(t0, t1));
+        }
+
+        if (t_near > t_far)
+          continue;
+
+        auto k = hit_count++;
+
+        for (; (k > 0) && (hits[k - 1].distance < t_near); k--)
+          hits[k] = hits[k - 1];
+
+        hits[k] = Entry{ node.child[i], node.primCount[i], t_near };
+      }
+
+      if (hit_count == 0)
+        break;
+
+      const auto first = std::max(0, (hit_count - 1) - static_cast<int>(stack_size - stack_top));
+
+      for (int k = first; k < (hit_count - 1); k++)
+        stack[stack_top++] = hits[k];
+
+      entry = hits[hit_count - 1];
+    }
+
+    if ((entry.primCount != 0) && leaf_fn(entry.index, entry.index + entry.primCount) && IsAnyHit)
+      return;
+  }
+}
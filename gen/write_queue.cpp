@@ -0,0 +1,87 @@
+#include "write_queue.h"
+
+#include <algorithm>
+
+WriteQueue::WriteQueue(const std::size_t threadCount, const std::size_t capacity)
+  : m_capacity(std::max<std::size_t>(capacity, 1))
+{
+  auto count = threadCount;
+
+  if (count == 0)
+    count = std::clamp<std::size_t>(std::thread::hardware_concurrency() / 4, 1, 4);
+
+  for (std::size_t i = 0; i < count; i++)
+    m_threads.emplace_back([this] { work(); });
+}
+
+WriteQueue::~WriteQueue()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+
+  m_jobReady.notify_all();
+
+  for (auto& t : m_threads)
+    t.join();
+}
+
+void
+WriteQueue::push(Job job)
+{
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_spaceReady.wait(lock, [this] { return m_jobs.size() < m_capacity; });
+    m_jobs.emplace_back(std::move(job));
+  }
+
+  m_jobReady.notify_one();
+}
+
+void
+WriteQueue::wait()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  m_idle.wait(lock, [this] { return m_jobs.empty() && (m_running == 0); });
+}
+
+void
+WriteQueue::work()
+{
+  while (true) {
+
+    Job job;
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      m_jobReady.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+
+      // Pending jobs are still run when stopping, so that no output is lost.
+      if (m_jobs.empty())
+        return;
+
+      job = std::move(m_jobs.front());
+
+      m_jobs.pop_front();
+
+      m_running++;
+    }
+
+    m_spaceReady.notify_one();
+
+    job();
+
+    // The job's captures (and the outputs they keep alive) are released before the queue can report being idle.
+    job = nullptr;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_running--;
+      if (m_jobs.empty() && (m_running == 0))
+        m_idle.notify_all();
+    }
+  }
+}
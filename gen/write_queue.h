@@ -0,0 +1,56 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstddef>
+
+// Runs output jobs (encoding and writing images, annotations) on a few background threads.
+//
+// The queue holds at most 'capacity' pending jobs. Pushing to a full queue blocks until a writer
+// catches up, which bounds the memory held by frames waiting to be written.
+class WriteQueue final
+{
+public:
+  using Job = std::function<void()>;
+
+  // A thread count of zero picks one from the number of hardware threads.
+  WriteQueue(std::size_t threadCount = 0, std::size_t capacity = 32);
+
+  WriteQueue(const WriteQueue&) = delete;
+
+  WriteQueue& operator=(const WriteQueue&) = delete;
+
+  // Finishes every pending job before returning.
+  ~WriteQueue();
+
+  void push(Job job);
+
+  // Blocks until every job pushed so far is done.
+  void wait();
+
+private:
+  void work();
+
+  std::mutex m_mutex;
+
+  std::condition_variable m_jobReady;
+
+  std::condition_variable m_spaceReady;
+
+  std::condition_variable m_idle;
+
+  std::deque<Job> m_jobs;
+
+  std::size_t m_capacity;
+
+  std::size_t m_running{ 0 };
+
+  bool m_stopping{ false };
+
+  std::vector<std::thread> m_threads;
+};